@@ -5,12 +5,29 @@
 #include <micmap.h>
 #include <gcstruct.h>
 #include <X11/extensions/render.h>
+#include <damage.h>
 #include "rpi_video.h"
 #include <migc.h>
 #include <mi.h>
 #include <xf86cmap.h>
 #include <fb.h>
+#include <fbpict.h>
+#include <mipict.h>
+#include <shmint.h>
+#include <xf86Crtc.h>
 #include <GLES/gl.h>
+#include <GLES/glext.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
 
 _X_EXPORT DriverRec RPIDriver = {
 	VERSION,
@@ -46,6 +63,13 @@ _X_EXPORT XF86ModuleData rpiModuleData = { &rpiVersRec, rpiSetup, NULL };
 static const OptionInfoRec RPIOptions[] = {
 	{ OPTION_HW_CURSOR, "HWcursor",  OPTV_BOOLEAN, {0}, FALSE },
 	{ OPTION_NOACCEL,   "NoAccel",   OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_RENDER_SIZE, "RenderSize", OPTV_STRING, {0}, FALSE },
+	{ OPTION_DISPLAY_RECT, "DisplayRect", OPTV_STRING, {0}, FALSE },
+	{ OPTION_DISPLAY,   "Display",   OPTV_INTEGER, {0}, FALSE },
+	{ OPTION_DEBUG_CONFIG, "DebugConfig", OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_RELEASE_ON_VT_SWITCH, "ReleaseOnVTSwitch", OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_CAPTURE,   "Capture",   OPTV_STRING,  {0}, FALSE },
+	{ OPTION_CAPTURE_SIZE, "CaptureSize", OPTV_INTEGER, {0}, FALSE },
 	{ -1,               NULL,        OPTV_NONE,    {0}, FALSE }
 };
 
@@ -135,201 +159,2295 @@ static pointer rpiSetup(pointer module, pointer opts, int *errmaj, int *errmin)
 	}
 }
 
+// GL resources every screen shares, see RPISharedRec
+static RPISharedRec RPIShared;
+
 static Bool RPIGetRec(ScrnInfoPtr pScrn)
 {
 	if( pScrn->driverPrivate != NULL ) return TRUE;
 	pScrn->driverPrivate = xnfcalloc(sizeof(RPIRec), 1);
 	if( pScrn->driverPrivate == NULL ) return FALSE;
+	RPIPTR(pScrn)->shared = &RPIShared;
 	return TRUE;
 }
 
 static void RPIFreeRec(ScrnInfoPtr pScrn)
 {
 	if( pScrn->driverPrivate == NULL ) return;
+	free(RPIPTR(pScrn)->Options);
 	free(pScrn->driverPrivate);
 	pScrn->driverPrivate = NULL;
 }
 
-static void RPISave( ScrnInfoPtr pScrn )
-{
-	ErrorF("RPISave\n");
-}
 
-EGLSurface RPICreateGLSurface( int w, int h, EGLDisplay display, EGLConfig config )
+// The surface is state->width x state->height; dispmanx scales the
+// state->srcRect part of it onto state->dstRect, so rendering below the
+// display resolution costs no GPU time. The new element and native window
+// are stored in state, the caller releases any previous ones.
+EGLSurface RPICreateGLSurface( RPIPtr state, EGLDisplay display, EGLConfig config )
 {
-  static EGL_DISPMANX_WINDOW_T nativewindow;
+  EGL_DISPMANX_WINDOW_T* nativewindow = calloc( 1, sizeof(EGL_DISPMANX_WINDOW_T) );
+  int w = state->width;
+  int h = state->height;
+  EGLSurface surface;
+
+  if( nativewindow == NULL )
+    return EGL_NO_SURFACE;
 
-  VC_RECT_T dst_rect;  
-  dst_rect.x = 0;
-  dst_rect.y = 0;
-  dst_rect.width = w;
-  dst_rect.height = h;
+  VC_RECT_T dst_rect = state->dstRect;
+  // X pixels carry no alpha; a fixed opacity also lets LeaveVT hide the element
+  VC_DISPMANX_ALPHA_T alpha = { DISPMANX_FLAGS_ALPHA_FIXED_ALL_PIXELS, 255, 0 };
 
   VC_RECT_T src_rect;
-  src_rect.x = 0;
-  src_rect.y = 0;
-  src_rect.width = w << 16;
-  src_rect.height = h << 16;
+  src_rect.x = state->srcRect.x << 16;
+  src_rect.y = state->srcRect.y << 16;
+  src_rect.width = state->srcRect.width << 16;
+  src_rect.height = state->srcRect.height << 16;
 
-  DISPMANX_DISPLAY_HANDLE_T dispman_display = vc_dispmanx_display_open( 0 );
+  if( state->dispmanDisplay == DISPMANX_NO_HANDLE )
+    state->dispmanDisplay = vc_dispmanx_display_open( state->displayNum );
   DISPMANX_UPDATE_HANDLE_T dispman_update = vc_dispmanx_update_start( 0 );
   
-  DISPMANX_ELEMENT_HANDLE_T dispman_element = vc_dispmanx_element_add( dispman_update, dispman_display, 0, &dst_rect, 0, &src_rect, DISPMANX_PROTECTION_NONE, 0, 0, 0 );
+  DISPMANX_ELEMENT_HANDLE_T dispman_element = vc_dispmanx_element_add( dispman_update, state->dispmanDisplay, 0, &dst_rect, 0, &src_rect, DISPMANX_PROTECTION_NONE, &alpha, 0, 0 );
 
-  nativewindow.element = dispman_element;
-  nativewindow.width = w;
-  nativewindow.height = h;
+  nativewindow->element = dispman_element;
+  nativewindow->width = w;
+  nativewindow->height = h;
   vc_dispmanx_update_submit_sync(dispman_update);
-  return eglCreateWindowSurface( display, config, &nativewindow, NULL );
+  surface = eglCreateWindowSurface( display, config, nativewindow, NULL );
+  if( surface == EGL_NO_SURFACE )
+  {
+    dispman_update = vc_dispmanx_update_start( 0 );
+    vc_dispmanx_element_remove( dispman_update, dispman_element );
+    vc_dispmanx_update_submit_sync( dispman_update );
+    free( nativewindow );
+    return EGL_NO_SURFACE;
+  }
+  // GC ops draw straight into the surface and are presented from the block
+  // handler, so the back buffer has to survive eglSwapBuffers
+  eglSurfaceAttrib( display, surface, EGL_SWAP_BEHAVIOR, EGL_BUFFER_PRESERVED );
+  state->element = dispman_element;
+  state->nativeWindow = nativewindow;
+  return surface;
+}
+
+// Points the shared context at this screen's surface. The viewport and
+// projection are context state, so they are reloaded on the next draw.
+static Bool RPIMakeCurrent( RPIPtr state )
+{
+  RPISharedPtr shared = state->shared;
+
+  if( state->surface == EGL_NO_SURFACE )
+    return FALSE;
+  if( shared->current == state )
+    return TRUE;
+  if( !eglMakeCurrent(shared->display, state->surface, state->surface, shared->context) )
+    return FALSE;
+  shared->current = state;
+  state->projectionValid = FALSE;
+  return TRUE;
+}
+
+static void RPIDestroyGLSurface( RPIPtr state, EGLSurface surface, DISPMANX_ELEMENT_HANDLE_T element, EGL_DISPMANX_WINDOW_T* nativewindow )
+{
+  eglDestroySurface( state->shared->display, surface );
+  DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start( 0 );
+  vc_dispmanx_element_remove( update, element );
+  vc_dispmanx_update_submit_sync( update );
+  free( nativewindow );
+}
+
+// Moves and scales the dispmanx element to the current srcRect/dstRect
+static void RPIUpdateElement( RPIPtr state )
+{
+  VC_RECT_T src_rect;
+  if( state->element == DISPMANX_NO_HANDLE )
+    return;
+  vc_dispmanx_rect_set( &src_rect, state->srcRect.x << 16, state->srcRect.y << 16,
+      state->srcRect.width << 16, state->srcRect.height << 16 );
+  DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start( 0 );
+  // bits 2 and 3 select the destination and source rectangles
+  vc_dispmanx_element_change_attributes( update, state->element, (1 << 2) | (1 << 3), 0, 0,
+      &state->dstRect, &src_rect, DISPMANX_NO_HANDLE, 0 );
+  vc_dispmanx_update_submit_sync( update );
+}
+
+static void RPISetElementOpacity( RPIPtr state, int opacity )
+{
+  DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start( 0 );
+  vc_dispmanx_element_change_attributes( update, state->element, 1 << 1, 0, opacity,
+      NULL, NULL, DISPMANX_NO_HANDLE, 0 );
+  vc_dispmanx_update_submit_sync( update );
+}
+
+// Gives the X screen a new size. Only the dispmanx element and the EGL
+// surface are replaced; the context, and with it every texture and cache,
+// carries on.
+static Bool RPIResizeSurface( RPIPtr state, int w, int h )
+{
+  EGLSurface oldSurface = state->surface;
+  DISPMANX_ELEMENT_HANDLE_T oldElement = state->element;
+  EGL_DISPMANX_WINDOW_T* oldWindow = state->nativeWindow;
+  int oldW = state->width, oldH = state->height;
+
+  if( w == state->width && h == state->height )
+    return TRUE;
+
+  state->width = w;
+  state->height = h;
+  state->surface = RPICreateGLSurface( state, state->shared->display, state->shared->config );
+  if( state->surface == EGL_NO_SURFACE ||
+      !eglMakeCurrent(state->shared->display, state->surface, state->surface, state->shared->context) )
+  {
+    if( state->surface != EGL_NO_SURFACE )
+      RPIDestroyGLSurface( state, state->surface, state->element, state->nativeWindow );
+    state->surface = oldSurface;
+    state->element = oldElement;
+    state->nativeWindow = oldWindow;
+    state->width = oldW;
+    state->height = oldH;
+    if( state->shared->current == state )
+      eglMakeCurrent( state->shared->display, oldSurface, oldSurface, state->shared->context );
+    return FALSE;
+  }
+  state->shared->current = state;
+  RPIDestroyGLSurface( state, oldSurface, oldElement, oldWindow );
+
+  state->projectionValid = FALSE;
+  state->stencilValid = FALSE;
+  glClearColor( 0.0f, 0.0f, 0.0f, 1.0f );
+  glClear( GL_COLOR_BUFFER_BIT );
+  state->dirty = TRUE;
+  return TRUE;
+}
+
+// Screens take the dispmanx display named by their Display option, or the
+// first of these in probe order that exists and no earlier screen drives
+static const uint32_t RPIDefaultDisplays[] = {
+	DISPMANX_ID_MAIN_LCD, DISPMANX_ID_HDMI, DISPMANX_ID_SDTV, DISPMANX_ID_AUX_LCD
+};
+
+// Whether a dispmanx display is the HDMI port, so tvservice applies to it
+static Bool RPIDisplayIsHDMI( uint32_t display )
+{
+	TV_DISPLAY_STATE_T tv;
+	uint32_t dw, dh;
+
+	if( display == DISPMANX_ID_HDMI )
+		return TRUE;
+	if( display != DISPMANX_ID_MAIN_LCD )
+		return FALSE;
+	// The main display is HDMI unless a DSI panel has taken it over
+	memset(&tv, 0, sizeof(tv));
+	if( vc_tv_get_display_state(&tv) != 0 || (tv.state & (VC_HDMI_HDMI | VC_HDMI_DVI)) == 0 )
+		return FALSE;
+	return graphics_get_display_size(display, &dw, &dh) >= 0 &&
+			dw == tv.display.hdmi.width && dh == tv.display.hdmi.height;
+}
+
+static Bool RPIIsHDMI( RPIPtr state )
+{
+	return RPIDisplayIsHDMI( state->displayNum );
+}
+
+// Whether an earlier screen already drives the output behind display.
+// Without a DSI panel the main display and HDMI are the same port.
+static Bool RPIDisplayTaken( ScrnInfoPtr pScrn, uint32_t display )
+{
+	for( int i = 0; i < pScrn->scrnIndex; ++i )
+	{
+		ScrnInfoPtr other = xf86Screens[i];
+		if( other == NULL || other->PreInit != RPIPreInit || RPIPTR(other) == NULL )
+			continue;
+		uint32_t taken = RPIPTR(other)->displayNum;
+		if( taken == display || (RPIDisplayIsHDMI(taken) && RPIDisplayIsHDMI(display)) )
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Works out the render size and where on the display it is scaled to from
+// the RenderSize ("WxH") and DisplayRect ("X,Y,WxH") options. Both default
+// to the full display.
+static Bool RPIGetRenderSize( ScrnInfoPtr pScrn, RPIPtr state )
+{
+	uint32_t dw, dh;
+	const char* s;
+	int x, y, w, h;
+	int display;
+
+	if( xf86GetOptValInteger(state->Options, OPTION_DISPLAY, &display) )
+		state->displayNum = display;
+	else
+	{
+		int i;
+		for( i = 0; i < (int)(sizeof(RPIDefaultDisplays) / sizeof(RPIDefaultDisplays[0])); ++i )
+		{
+			if( !RPIDisplayTaken(pScrn, RPIDefaultDisplays[i]) &&
+					graphics_get_display_size(RPIDefaultDisplays[i], &dw, &dh) >= 0 )
+				break;
+		}
+		if( i == (int)(sizeof(RPIDefaultDisplays) / sizeof(RPIDefaultDisplays[0])) )
+		{
+			ERROR_MSG("No free display for screen %d, set the Display option", pScrn->scrnIndex);
+			return FALSE;
+		}
+		state->displayNum = RPIDefaultDisplays[i];
+	}
+	if( graphics_get_display_size(state->displayNum, &dw, &dh) < 0 )
+	{
+		ERROR_MSG("Unable to query the size of display %u", state->displayNum);
+		return FALSE;
+	}
+	state->displayWidth = dw;
+	state->displayHeight = dh;
+	vc_dispmanx_rect_set( &state->dstRect, 0, 0, dw, dh );
+	state->width = dw;
+	state->height = dh;
+	state->fixedSize = FALSE;
+	state->fixedRect = FALSE;
+
+	if( (s = xf86GetOptValString(state->Options, OPTION_DISPLAY_RECT)) != NULL )
+	{
+		if( sscanf(s, "%d,%d,%dx%d", &x, &y, &w, &h) != 4 || w <= 0 || h <= 0 )
+		{
+			ERROR_MSG("DisplayRect \"%s\" is not of the form X,Y,WxH", s);
+			return FALSE;
+		}
+		vc_dispmanx_rect_set( &state->dstRect, x, y, w, h );
+		state->width = w;
+		state->height = h;
+		state->fixedSize = TRUE;
+		state->fixedRect = TRUE;
+	}
+
+	if( (s = xf86GetOptValString(state->Options, OPTION_RENDER_SIZE)) != NULL )
+	{
+		if( sscanf(s, "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0 || w > 2048 || h > 2048 )
+		{
+			ERROR_MSG("RenderSize \"%s\" is not of the form WxH, up to 2048x2048", s);
+			return FALSE;
+		}
+		state->width = w;
+		state->height = h;
+		state->fixedSize = TRUE;
+	}
+	vc_dispmanx_rect_set( &state->srcRect, 0, 0, state->width, state->height );
+
+	CONFIG_MSG("Rendering at %dx%d, scaled to %dx%d+%d+%d on display %u (%dx%d)",
+			state->width, state->height, state->dstRect.width, state->dstRect.height,
+			state->dstRect.x, state->dstRect.y, state->displayNum, dw, dh);
+	return TRUE;
+}
+
+// RandR 1.2: a single CRTC driving the HDMI output. Modes are the ones the
+// firmware reports, and the X screen is the EGL surface, so changing its size
+// swaps the surface under the live context instead of reinitialising GL.
+
+#define RPI_MAX_FIRMWARE_MODES 64
+#define RPI_MODE_GROUP(m) ((HDMI_RES_GROUP_T)((m)->PrivFlags >> 16))
+#define RPI_MODE_CODE(m) ((uint32_t)((m)->PrivFlags & 0xffff))
+
+static Bool RPICrtcResize( ScrnInfoPtr pScrn, int width, int height )
+{
+	RPIPtr state = RPIPTR(pScrn);
+	ScreenPtr pScreen = screenInfo.screens[pScrn->scrnIndex];
+
+	if( width == state->width && height == state->height )
+		return TRUE;
+	if( state->released || !RPIResizeSurface(state, width, height) )
+	{
+		ERROR_MSG("Unable to resize the screen to %dx%d", width, height);
+		return FALSE;
+	}
+	pScrn->virtualX = width;
+	pScrn->virtualY = height;
+	pScrn->displayWidth = width;
+	if( pScreen != NULL )
+	{
+		PixmapPtr pPix = pScreen->GetScreenPixmap(pScreen);
+		pScreen->ModifyPixmapHeader(pPix, width, height, -1, -1, PixmapBytePad(width, pScrn->depth), NULL);
+	}
+	INFO_MSG("Screen resized to %dx%d", width, height);
+	return TRUE;
+}
+
+static const xf86CrtcConfigFuncsRec RPICrtcConfigFuncs = {
+	RPICrtcResize
+};
+
+static void RPICrtcDPMS( xf86CrtcPtr crtc, int mode )
+{
+}
+
+// Finds the firmware group/code for a mode; RandR hands us converted copies,
+// so match the timings against the probed list
+static DisplayModePtr RPIFirmwareMode( xf86CrtcPtr crtc, DisplayModePtr mode )
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+
+	for( int i = 0; i < config->num_output; ++i )
+	{
+		if( config->output[i]->crtc != crtc )
+			continue;
+		for( DisplayModePtr m = config->output[i]->probed_modes; m != NULL; m = m->next )
+		{
+			if( m->PrivFlags != 0 && xf86ModesEqual(m, mode) )
+				return m;
+		}
+	}
+	return NULL;
+}
+
+// tvservice reports a finished HDMI mode change from its own thread
+static pthread_mutex_t RPITvLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t RPITvChanged = PTHREAD_COND_INITIALIZER;
+static unsigned int RPITvEvents;
+static Bool RPITvCallbackRegistered = FALSE;
+
+static void RPITvCallback( void* data, uint32_t reason, uint32_t param1, uint32_t param2 )
+{
+	if( (reason & (VC_HDMI_HDMI | VC_HDMI_DVI)) == 0 )
+		return;
+	pthread_mutex_lock( &RPITvLock );
+	RPITvEvents++;
+	pthread_cond_broadcast( &RPITvChanged );
+	pthread_mutex_unlock( &RPITvLock );
+}
+
+static unsigned int RPITvEventCount( void )
+{
+	pthread_mutex_lock( &RPITvLock );
+	unsigned int events = RPITvEvents;
+	pthread_mutex_unlock( &RPITvLock );
+	return events;
+}
+
+// Waits up to timeout ms for a mode change notification after the one
+// counted in events. Returns FALSE on timeout.
+static Bool RPITvWait( unsigned int events, int timeout )
+{
+	struct timespec deadline;
+	int err = 0;
+
+	clock_gettime( CLOCK_REALTIME, &deadline );
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000L;
+	if( deadline.tv_nsec >= 1000000000L )
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock( &RPITvLock );
+	while( RPITvEvents == events && err != ETIMEDOUT )
+		err = pthread_cond_timedwait( &RPITvChanged, &RPITvLock, &deadline );
+	Bool changed = RPITvEvents != events;
+	pthread_mutex_unlock( &RPITvLock );
+	return changed;
+}
+
+// Switches the HDMI timing if needed, then points the dispmanx element at the
+// CRTC's part of the screen. The GL surface is left alone.
+static Bool RPICrtcSetModeMajor( xf86CrtcPtr crtc, DisplayModePtr mode, Rotation rotation, int x, int y )
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	RPIPtr state = RPIPTR(pScrn);
+	DisplayModePtr fw = RPIFirmwareMode(crtc, mode);
+	uint32_t dw, dh;
+
+	if( rotation != RR_Rotate_0 )
+		return FALSE;
+
+	if( fw != NULL && !state->fixedSize && RPIIsHDMI(state) )
+	{
+		TV_DISPLAY_STATE_T tv;
+		memset(&tv, 0, sizeof(tv));
+		vc_tv_get_display_state(&tv);
+		if( (tv.state & (VC_HDMI_HDMI | VC_HDMI_DVI)) == 0 || tv.display.hdmi.group != RPI_MODE_GROUP(fw) ||
+				tv.display.hdmi.mode != RPI_MODE_CODE(fw) )
+		{
+			unsigned int events = RPITvEventCount();
+			if( vc_tv_hdmi_power_on_explicit_new(tv.state & VC_HDMI_DVI ? HDMI_MODE_DVI : HDMI_MODE_HDMI,
+					RPI_MODE_GROUP(fw), RPI_MODE_CODE(fw)) != 0 )
+			{
+				ERROR_MSG("Firmware refused mode %s", mode->name);
+				return FALSE;
+			}
+			// The switch is asynchronous; tvservice calls back once the
+			// display runs the new mode
+			if( !RPITvCallbackRegistered || !RPITvWait(events, 1000) )
+				WARNING_MSG("No notification from the firmware that mode %s is set", mode->name);
+		}
+	}
+	if( graphics_get_display_size(state->displayNum, &dw, &dh) >= 0 )
+	{
+		state->displayWidth = dw;
+		state->displayHeight = dh;
+	}
+
+	crtc->mode = *mode;
+	crtc->x = x;
+	crtc->y = y;
+	crtc->rotation = rotation;
+	vc_dispmanx_rect_set( &state->srcRect, x, y, mode->HDisplay, mode->VDisplay );
+	if( !state->fixedRect )
+		vc_dispmanx_rect_set( &state->dstRect, 0, 0, state->displayWidth, state->displayHeight );
+	RPIUpdateElement(state);
+	return TRUE;
+}
+
+static void RPICrtcSetOrigin( xf86CrtcPtr crtc, int x, int y )
+{
+	RPIPtr state = RPIPTR(crtc->scrn);
+
+	crtc->x = x;
+	crtc->y = y;
+	state->srcRect.x = x;
+	state->srcRect.y = y;
+	RPIUpdateElement(state);
+}
+
+static void RPICrtcDestroy( xf86CrtcPtr crtc )
+{
+}
+
+static const xf86CrtcFuncsRec RPICrtcFuncs = {
+	.dpms = RPICrtcDPMS,
+	.set_mode_major = RPICrtcSetModeMajor,
+	.set_origin = RPICrtcSetOrigin,
+	.destroy = RPICrtcDestroy,
+};
+
+static void RPIOutputDPMS( xf86OutputPtr output, int mode )
+{
+}
+
+static xf86OutputStatus RPIOutputDetect( xf86OutputPtr output )
+{
+	return XF86OutputStatusConnected;
+}
+
+static int RPIOutputModeValid( xf86OutputPtr output, DisplayModePtr mode )
+{
+	return MODE_OK;
+}
+
+// Adds a w x h mode at refresh Hz. clock is the pixel clock in Hz the
+// firmware drives it with, or 0 when unknown.
+static DisplayModePtr RPIOutputAddMode( DisplayModePtr modes, int w, int h, float refresh, uint32_t clock, int type, unsigned long privFlags )
+{
+	DisplayModePtr m = xf86CVTMode(w, h, refresh, FALSE, FALSE);
+	if( m == NULL )
+		return modes;
+	// The firmware only reports the active size, rate and pixel clock, so
+	// CVT places the syncs and the horizontal blanking is stretched until
+	// the totals run at the firmware's clock and rate
+	if( clock != 0 && refresh > 0 )
+	{
+		int htotal = (int)(clock / ((uint32_t)refresh * m->VTotal));
+		if( htotal > m->HSyncEnd )
+		{
+			m->HTotal = htotal;
+			m->Clock = clock / 1000;
+			// Zeroed so they are worked out again from the new totals
+			m->HSync = 0;
+			m->VRefresh = 0;
+			m->HSync = xf86ModeHSync(m);
+			m->VRefresh = xf86ModeVRefresh(m);
+		}
+	}
+	m->type = M_T_DRIVER | type;
+	m->PrivFlags = privFlags;
+	xf86SetModeDefaultName(m);
+	return xf86ModesAdd(modes, m);
+}
+
+// CEA and DMT modes from the HDMI sink, progressive only. Other displays
+// have a single mode. With RenderSize or
+// DisplayRect the screen has exactly one mode, the render size.
+static DisplayModePtr RPIOutputGetModes( xf86OutputPtr output )
+{
+	ScrnInfoPtr pScrn = output->scrn;
+	RPIPtr state = RPIPTR(pScrn);
+	static const HDMI_RES_GROUP_T groups[] = { HDMI_RES_GROUP_CEA, HDMI_RES_GROUP_DMT };
+	TV_SUPPORTED_MODE_NEW_T supported[RPI_MAX_FIRMWARE_MODES];
+	DisplayModePtr modes = NULL;
+	uint32_t dw, dh;
+
+	if( state->fixedSize )
+		return RPIOutputAddMode(NULL, state->width, state->height, 60.0f, 0, M_T_PREFERRED, 0);
+
+	for( int g = 0; g < 2 && RPIIsHDMI(state); ++g )
+	{
+		HDMI_RES_GROUP_T prefGroup;
+		uint32_t prefCode;
+		int n = vc_tv_hdmi_get_supported_modes_new(groups[g], supported, RPI_MAX_FIRMWARE_MODES, &prefGroup, &prefCode);
+		for( int i = 0; i < n; ++i )
+		{
+			if( supported[i].scan_mode || supported[i].width > 2048 || supported[i].height > 2048 )
+				continue;
+			modes = RPIOutputAddMode(modes, supported[i].width, supported[i].height, supported[i].frame_rate,
+					supported[i].pixel_freq, supported[i].native ? M_T_PREFERRED : 0, (groups[g] << 16) | supported[i].code);
+		}
+	}
+
+	// LCD or composite output, or a sink without EDID: offer what is running now
+	if( modes == NULL && graphics_get_display_size(state->displayNum, &dw, &dh) >= 0 )
+		modes = RPIOutputAddMode(NULL, dw, dh, 60.0f, 0, M_T_PREFERRED, 0);
+	return modes;
+}
+
+static void RPIOutputDestroy( xf86OutputPtr output )
+{
+}
+
+static const xf86OutputFuncsRec RPIOutputFuncs = {
+	.dpms = RPIOutputDPMS,
+	.mode_valid = RPIOutputModeValid,
+	.detect = RPIOutputDetect,
+	.get_modes = RPIOutputGetModes,
+	.destroy = RPIOutputDestroy,
+};
+
+static Bool RPIOutputInit( ScrnInfoPtr pScrn )
+{
+	RPIPtr state = RPIPTR(pScrn);
+	xf86CrtcPtr crtc;
+	xf86OutputPtr output;
+	const char* name;
+
+	xf86CrtcConfigInit(pScrn, &RPICrtcConfigFuncs);
+	if( state->fixedSize )
+		xf86CrtcSetSizeRange(pScrn, state->width, state->height, state->width, state->height);
+	else
+		xf86CrtcSetSizeRange(pScrn, 320, 200, 2048, 2048);
+
+	if( (crtc = xf86CrtcCreate(pScrn, &RPICrtcFuncs)) == NULL )
+		return FALSE;
+	name = RPIIsHDMI(state) ? "HDMI-1" : state->displayNum == DISPMANX_ID_SDTV ? "TV-1" : "LCD-1";
+	if( RPIIsHDMI(state) && !RPITvCallbackRegistered )
+	{
+		vc_tv_register_callback( RPITvCallback, NULL );
+		RPITvCallbackRegistered = TRUE;
+	}
+	if( (output = xf86OutputCreate(pScrn, &RPIOutputFuncs, name)) == NULL )
+		return FALSE;
+	output->possible_crtcs = 1;
+	output->possible_clones = 0;
+
+	if( !xf86InitialConfiguration(pScrn, TRUE) )
+	{
+		ERROR_MSG("No usable modes");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Connects to EGL and picks a config with exactly the screen's colour
+// depth. Runs on RPIShared.initThread, so it must not log or touch X state.
+static Bool RPIInitEGL( RPISharedPtr shared )
+{
+	EGLConfig configs[32];
+	EGLint num_config;
+
+	const Bool rgb565 = shared->depth == 16;
+	const EGLint attribute_list[] =
+	{
+		EGL_RED_SIZE, rgb565 ? 5 : 8,
+		EGL_GREEN_SIZE, rgb565 ? 6 : 8,
+		EGL_BLUE_SIZE, rgb565 ? 5 : 8,
+		EGL_ALPHA_SIZE, rgb565 ? 0 : 8,
+		EGL_STENCIL_SIZE, 8,
+		EGL_SURFACE_TYPE, EGL_WINDOW_BIT | EGL_SWAP_BEHAVIOR_PRESERVED_BIT,
+		EGL_NONE
+	};
+
+	// get an EGL display connection
+	shared->display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if( shared->display == EGL_NO_DISPLAY )
+		goto fail;
+
+	// initialize the EGL display connection
+	if( !eglInitialize(shared->display, NULL, NULL) )
+		goto fail;
+
+	// get an appropriate EGL frame buffer configuration. EGL sorts deeper
+	// colour buffers first, so look for an exact match to the screen depth
+	if( !eglChooseConfig(shared->display, attribute_list, configs, 32, &num_config) || num_config <= 0 )
+		goto fail;
+	shared->config = configs[0];
+	for( int i = 0; i < num_config; ++i )
+	{
+		EGLint r, g, b, a;
+		eglGetConfigAttrib(shared->display, configs[i], EGL_RED_SIZE, &r);
+		eglGetConfigAttrib(shared->display, configs[i], EGL_GREEN_SIZE, &g);
+		eglGetConfigAttrib(shared->display, configs[i], EGL_BLUE_SIZE, &b);
+		eglGetConfigAttrib(shared->display, configs[i], EGL_ALPHA_SIZE, &a);
+		if( r == attribute_list[1] && g == attribute_list[3] && b == attribute_list[5] && a == attribute_list[7] )
+		{
+			shared->config = configs[i];
+			break;
+		}
+	}
+	return TRUE;
+
+fail:
+	shared->initError = eglGetError();
+	return FALSE;
+}
+
+static void* RPIInitEGLThread( void* arg )
+{
+	RPISharedPtr shared = arg;
+	shared->initOk = RPIInitEGL(shared);
+	return NULL;
+}
+
+// Called from PreInit once the depth is known. EGL comes up in the
+// background while the rest of PreInit, RandR probing included, carries on.
+static Bool RPIStartEGL( ScrnInfoPtr pScrn )
+{
+	RPIPtr state = RPIPTR(pScrn);
+	RPISharedPtr shared = state->shared;
+
+	if( shared->initPending || shared->display != EGL_NO_DISPLAY )
+	{
+		if( shared->depth != state->depth )
+		{
+			ERROR_MSG("All screens must have the same depth (%d)", shared->depth);
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	shared->depth = state->depth;
+	shared->startTime = GetTimeInMillis();
+	if( pthread_create(&shared->initThread, NULL, RPIInitEGLThread, shared) == 0 )
+	{
+		shared->initPending = TRUE;
+		return TRUE;
+	}
+	shared->initOk = RPIInitEGL(shared);
+	return TRUE;
+}
+
+// Called from ScreenInit: waits for EGL, creates the context on first use
+// and gives this screen its surface. Everything created here outlives a
+// server regeneration.
+static Bool RPIStartGL( ScrnInfoPtr pScrn )
+{
+	RPIPtr state = RPIPTR(pScrn);
+	RPISharedPtr shared = state->shared;
+	Bool newContext = FALSE;
+
+	if( shared->initPending )
+	{
+		pthread_join(shared->initThread, NULL);
+		shared->initPending = FALSE;
+		INFO_MSG("EGL ready after %u ms", (unsigned)(GetTimeInMillis() - shared->startTime));
+	}
+	if( !shared->initOk )
+	{
+		ERROR_MSG("EGL initialisation failed (0x%x)", shared->initError);
+		return FALSE;
+	}
+	if( xf86ReturnOptValBool(state->Options, OPTION_DEBUG_CONFIG, FALSE) )
+		printConfig(shared->display, shared->config);
+
+	// create an EGL rendering context
+	if( shared->context == EGL_NO_CONTEXT )
+	{
+		shared->context = eglCreateContext(shared->display, shared->config, EGL_NO_CONTEXT, 0);
+		if( shared->context == EGL_NO_CONTEXT )
+		{
+			ERROR_MSG("Unable to create a GL context (0x%x)", eglGetError());
+			return FALSE;
+		}
+		newContext = TRUE;
+	}
+
+	if( state->surface != EGL_NO_SURFACE )
+		return TRUE;
+	state->surface = RPICreateGLSurface(state, shared->display, shared->config );
+	if( state->surface == EGL_NO_SURFACE )
+	{
+		ERROR_MSG("Unable to create a surface on display %u (0x%x)", state->displayNum, eglGetError());
+		return FALSE;
+	}
+	if( !RPIMakeCurrent(state) )
+	{
+		ERROR_MSG("Unable to make the GL context current (0x%x)", eglGetError());
+		return FALSE;
+	}
+	if( newContext )
+	{
+		shared->hasBGRA = strstr( (const char*)glGetString(GL_EXTENSIONS), "GL_EXT_texture_format_BGRA8888" ) != NULL;
+		shared->logicOp = GL_COPY;
+		shared->program = RPI_FILL_SOLID;
+	}
+
+	// Start from black rather than whatever the buffer held; the block
+	// handler presents it with the root window
+	glClearColor( 0.0f, 0.0f, 0.0f, 1.0f );
+	glClear( GL_COLOR_BUFFER_BIT );
+	state->dirty = TRUE;
+	return TRUE;
+}
+
+static Bool RPIPreInit(ScrnInfoPtr pScrn,int flags)
+{
+	ErrorF("Start PreInit\n");
+
+	pScrn->monitor = pScrn->confScreen->monitor;
+
+	RPIGetRec(pScrn);
+	RPIPtr state = RPIPTR(pScrn);
+
+	xf86CollectOptions(pScrn, NULL);
+	if( (state->Options = malloc(sizeof(RPIOptions))) == NULL )
+	{
+		goto fail;
+	}
+	memcpy(state->Options, RPIOptions, sizeof(RPIOptions));
+	xf86ProcessOptions(pScrn->scrnIndex, pScrn->options, state->Options);
+	bcm_host_init();
+	if( !RPIGetRenderSize(pScrn, state) )
+	{
+		goto fail;
+	}
+
+  // Depth 24 at 32 bpp by default; DefaultDepth 16 gives an RGB565 screen
+  // with half the memory traffic
+  if( !xf86SetDepthBpp(pScrn,0,0,0,Support32bppFb) )
+	{
+		goto fail;
+	}
+	if( pScrn->depth != 16 && pScrn->depth != 24 )
+	{
+		ERROR_MSG("Depth %d is not supported, use 16 or 24", pScrn->depth);
+		goto fail;
+	}
+	xf86PrintDepthBpp(pScrn);
+	state->depth = pScrn->depth;
+	if( !RPIStartEGL(pScrn) )
+	{
+		goto fail;
+	}
+	
+	rgb c;
+	c.red = 0;
+	c.green = 0;
+	c.blue = 0;
+	if( !xf86SetWeight(pScrn,c,c) )
+	{
+		goto fail;
+	}
+
+	Gamma g;
+	g.red = 0;
+	g.green = 0;
+	g.blue = 0;
+	if( !xf86SetGamma(pScrn,g) )
+	{
+		goto fail;
+	}
+
+	// Should be auto-detecting TrueColor, doesn't...
+	if( !xf86SetDefaultVisual(pScrn, TrueColor) )
+	{
+		goto fail;
+	}
+
+	// The X screen, and with it pointer and touch coordinates, follow the
+	// render size rather than the display
+	if( !RPIOutputInit(pScrn) )
+	{
+		goto fail;
+	}
+	pScrn->displayWidth = pScrn->virtualX;
+	state->width = pScrn->virtualX;
+	state->height = pScrn->virtualY;
+	vc_dispmanx_rect_set( &state->srcRect, 0, 0, pScrn->currentMode->HDisplay, pScrn->currentMode->VDisplay );
+	//	intel_glamor_pre_init(pScrn);	
+ 
+  ErrorF("PreInit Success\n");
+	return TRUE;
+
+fail:
+	ErrorF("PreInit Failed\n");
+	RPIFreeRec(pScrn);
+	return FALSE;
+}
+
+static Bool RPIModeInit(ScrnInfoPtr pScrn, DisplayModePtr pMode)
+{
+	ErrorF("RPIModeInit\n");
+	return TRUE;
+}
+
+static RPIPtr RPIDrawableState( DrawablePtr pDraw )
+{
+	return RPIPTR(xf86Screens[pDraw->pScreen->myNum]);
+}
+
+// Windows draw to the GL surface unless Composite has redirected them into
+// a pixmap of their own, which fb renders like any other pixmap
+static Bool RPIOnScreen( DrawablePtr pDraw )
+{
+	return pDraw->type == DRAWABLE_WINDOW &&
+			fbGetWindowPixmap((WindowPtr)pDraw) == pDraw->pScreen->devPrivate;
+}
+
+// Returns at least size bytes of scratch space, valid until the next call
+static void* RPIScratch( RPIPtr state, size_t size )
+{
+	if( size > state->shared->scratchSize )
+	{
+		void* p = realloc( state->shared->scratch, size );
+		if( p == NULL )
+			return NULL;
+		state->shared->scratch = p;
+		state->shared->scratchSize = size;
+	}
+	return state->shared->scratch;
+}
+
+static void RPIPixelToColor( ScrnInfoPtr pScrn, Pixel pixel, GLfloat* rgba )
+{
+	rgba[0] = (GLfloat)((pixel & pScrn->mask.red) >> pScrn->offset.red) / (GLfloat)(pScrn->mask.red >> pScrn->offset.red);
+	rgba[1] = (GLfloat)((pixel & pScrn->mask.green) >> pScrn->offset.green) / (GLfloat)(pScrn->mask.green >> pScrn->offset.green);
+	rgba[2] = (GLfloat)((pixel & pScrn->mask.blue) >> pScrn->offset.blue) / (GLfloat)(pScrn->mask.blue >> pScrn->offset.blue);
+	rgba[3] = 1.0f;
+}
+
+// Maps GL coordinates one to one onto screen pixels
+static void RPILoadProjection( RPIPtr state )
+{
+	if( !state->projectionValid )
+	{
+		glViewport( 0, 0, (GLsizei)state->width, (GLsizei)state->height );
+		glMatrixMode( GL_PROJECTION );
+		glLoadIdentity();
+		glOrthof( 0, state->width, state->height, 0, -1, 1 );
+		state->projectionValid = TRUE;
+	}
+	glMatrixMode( GL_MODELVIEW );
+	glLoadIdentity();
+}
+
+// Pixels restored per block handler call while nothing else draws
+#define RPI_RESTORE_BUDGET (256 * 1024)
+
+static void RPIRestoreStep( RPIPtr state, long budget );
+static void RPIRestoreArea( RPIPtr state, const BoxRec* area );
+static void RPIFlushBackgrounds( RPIPtr state );
+
+// Sets up GL to draw into pDraw in screen coordinates. Returns FALSE when
+// the drawable does not live on the EGL surface and fb has to handle it.
+static Bool RPIPrepareDraw( RPIPtr state, DrawablePtr pDraw )
+{
+	if( !RPIOnScreen(pDraw) || !RPIMakeCurrent(state) )
+		return FALSE;
+
+	// New drawing must land on top of the restored screen, so after a VT
+	// switch whatever is still pending under the window goes up first
+	if( state->restoring )
+		RPIRestoreArea( state, RegionExtents(&((WindowPtr)pDraw)->borderClip) );
+	RPILoadProjection( state );
+	state->dirty = TRUE;
+	// Exposed backgrounds go under whatever is drawn next
+	if( state->nBackgrounds > 0 )
+		RPIFlushBackgrounds( state );
+	return TRUE;
+}
+
+static DevPrivateKeyRec RPIGCPrivateKeyRec;
+static DevPrivateKeyRec RPIPixmapPrivateKeyRec;
+
+static RPIGCPrivPtr RPIGetGCPriv( GCPtr pGC )
+{
+	return dixGetPrivateAddr(&pGC->devPrivates, &RPIGCPrivateKeyRec);
+}
+
+static RPIPixmapPrivPtr RPIGetPixmapPriv( PixmapPtr pPix )
+{
+	return dixGetPrivateAddr(&pPix->devPrivates, &RPIPixmapPrivateKeyRec);
+}
+
+// The pixmap holding an off screen drawable's bits, with the drawable's
+// origin in it as fbGetDrawable works it out
+static PixmapPtr RPIDrawablePixmap( DrawablePtr pDraw, int* xoff, int* yoff )
+{
+	*xoff = 0;
+	*yoff = 0;
+	if( pDraw->type == DRAWABLE_PIXMAP )
+		return (PixmapPtr)pDraw;
+
+	PixmapPtr pPix = fbGetWindowPixmap((WindowPtr)pDraw);
+#ifdef COMPOSITE
+	*xoff = pDraw->x - pPix->screen_x;
+	*yoff = pDraw->y - pPix->screen_y;
+#endif
+	return pPix;
+}
+
+// Called after fb has written into a pixmap or a redirected window, so any
+// GL copy of its pixmap is stale
+static void RPIPixmapDamage( DrawablePtr pDraw )
+{
+	int xoff, yoff;
+	PixmapPtr pPix = RPIDrawablePixmap( pDraw, &xoff, &yoff );
+
+	if( pPix != pDraw->pScreen->devPrivate )
+		RPIGetPixmapPriv(pPix)->damage++;
+}
+
+static int RPINextPow2( int v )
+{
+	int p = 1;
+	while( p < v )
+		p <<= 1;
+	return p;
+}
+
+// Texture width used for a tile dimension. Power of two tiles wrap with
+// GL_REPEAT; anything else is replicated across at least 256 texels so a
+// fill needs few tile period splits.
+static int RPITileTexSize( int size )
+{
+	if( (size & (size - 1)) == 0 )
+		return size;
+	return RPINextPow2( size < 256 ? 256 : size );
+}
+
+#if BITMAP_BIT_ORDER == LSBFirst
+#define RPI_BIT(x) (1 << (x))
+#else
+#define RPI_BIT(x) (0x80 >> (x))
+#endif
+
+#ifndef __ARM_NEON__
+// 0x00/0xff expansion of every source byte
+static CARD8 RPIBitUnpack[256][8];
+static Bool RPIBitUnpackReady = FALSE;
+#endif
+
+// Expands a row of 1 bpp pixels into one alpha byte per pixel
+static void RPIExpandBitmapRow( const CARD8* src, CARD8* dst, int w )
+{
+	int x = 0;
+#ifdef __ARM_NEON__
+#if BITMAP_BIT_ORDER == LSBFirst
+	const uint8x8_t bits = vcreate_u8( 0x8040201008040201ULL );
+#else
+	const uint8x8_t bits = vcreate_u8( 0x0102040810204080ULL );
+#endif
+	for( ; x + 16 <= w; x += 16 )
+	{
+		uint8x16_t v = vcombine_u8( vdup_n_u8(src[x >> 3]), vdup_n_u8(src[(x >> 3) + 1]) );
+		vst1q_u8( dst + x, vtstq_u8( v, vcombine_u8(bits, bits) ) );
+	}
+	for( ; x + 8 <= w; x += 8 )
+		vst1_u8( dst + x, vtst_u8( vdup_n_u8(src[x >> 3]), bits ) );
+#else
+	if( !RPIBitUnpackReady )
+	{
+		for( int b = 0; b < 256; ++b )
+			for( int i = 0; i < 8; ++i )
+				RPIBitUnpack[b][i] = (b & RPI_BIT(i)) ? 0xff : 0;
+		RPIBitUnpackReady = TRUE;
+	}
+	for( ; x + 8 <= w; x += 8 )
+		memcpy( dst + x, RPIBitUnpack[src[x >> 3]], 8 );
+#endif
+	for( ; x < w; ++x )
+		dst[x] = (src[x >> 3] & RPI_BIT(x & 7)) ? 0xff : 0;
+}
+
+// Expands one bit plane of a row into one alpha byte per pixel
+static void RPIExpandPlaneRow( const CARD8* src, CARD8* dst, int w, int bpp, unsigned long plane )
+{
+	switch( bpp )
+	{
+	case 8:
+		for( int x = 0; x < w; ++x )
+			dst[x] = (src[x] & plane) ? 0xff : 0;
+		break;
+	case 16:
+		for( int x = 0; x < w; ++x )
+			dst[x] = (((const CARD16*)src)[x] & plane) ? 0xff : 0;
+		break;
+	case 32:
+		for( int x = 0; x < w; ++x )
+			dst[x] = (((const CARD32*)src)[x] & plane) ? 0xff : 0;
+		break;
+	}
+}
+
+// Swaps red and blue and sets alpha, which turns x8r8g8b8 into GL_RGBA
+// and GL_RGBA back into x8r8g8b8
+static void RPISwizzleRow( const CARD8* src, CARD8* dst, int w )
+{
+	int x = 0;
+#ifdef __ARM_NEON__
+	for( ; x + 8 <= w; x += 8 )
+	{
+		uint8x8x4_t px = vld4_u8( src + x * 4 );
+		uint8x8_t r = px.val[2];
+		px.val[2] = px.val[0];
+		px.val[0] = r;
+		px.val[3] = vdup_n_u8( 0xff );
+		vst4_u8( dst + x * 4, px );
+	}
+#endif
+	for( ; x < w; ++x )
+	{
+		CARD8 r = src[x*4+2];
+		dst[x*4+2] = src[x*4];
+		dst[x*4+1] = src[x*4+1];
+		dst[x*4] = r;
+		dst[x*4+3] = 0xff;
+	}
+}
+
+// Packs a row of GL_RGBA pixels into RGB565
+static void RPIPackRow565( const CARD8* src, CARD16* dst, int w )
+{
+	int x = 0;
+#ifdef __ARM_NEON__
+	for( ; x + 8 <= w; x += 8 )
+	{
+		uint8x8x4_t px = vld4_u8( src + x * 4 );
+		uint16x8_t p = vshll_n_u8( px.val[0], 8 );
+		p = vsriq_n_u16( p, vshll_n_u8(px.val[1], 8), 5 );
+		p = vsriq_n_u16( p, vshll_n_u8(px.val[2], 8), 11 );
+		vst1q_u16( dst + x, p );
+	}
+#endif
+	for( ; x < w; ++x )
+		dst[x] = ((src[x*4] & 0xf8) << 8) | ((src[x*4+1] & 0xfc) << 3) | (src[x*4+2] >> 3);
+}
+
+// Reads back a screen area (screen coordinates) in the screen's pixel
+// format into dst
+static Bool RPIReadPixels( RPIPtr state, int x, int y, int w, int h, CARD8* dst, int stride )
+{
+	if( !RPIMakeCurrent(state) )
+		return FALSE;
+	if( state->restoring )
+	{
+		BoxRec area = { x, y, x + w, y + h };
+		RPIRestoreArea( state, &area );
+	}
+	if( state->nBackgrounds > 0 )
+	{
+		RPILoadProjection( state );
+		RPIFlushBackgrounds( state );
+	}
+	// Only after the restore and the flush: both convert uploads in the
+	// scratch space, and growing it would leave buf dangling
+	CARD8* buf = RPIScratch( state, (size_t)w * h * 4 );
+	if( buf == NULL )
+		return FALSE;
+
+	glPixelStorei( GL_PACK_ALIGNMENT, 4 );
+	glReadPixels( x, state->height - y - h, w, h, GL_RGBA, GL_UNSIGNED_BYTE, buf );
+	// GL rows run bottom up
+	for( int row = 0; row < h; ++row )
+	{
+		const CARD8* src = buf + (size_t)(h - 1 - row) * w * 4;
+		if( state->depth == 16 )
+			RPIPackRow565( src, (CARD16*)(dst + row * stride), w );
+		else
+			RPISwizzleRow( src, dst + row * stride, w );
+	}
+	return TRUE;
+}
+
+// Converts one pixmap row into the layout RPIUploadPixmap passes to GL
+static void RPIConvertRow( RPIPtr state, const CARD8* src, CARD8* dst, int w, int bpp, unsigned long plane )
+{
+	if( plane != 0 )
+	{
+		RPIExpandPlaneRow( src, dst, w, bpp, plane );
+		return;
+	}
+	switch( bpp )
+	{
+	case 1:
+		RPIExpandBitmapRow( src, dst, w );
+		break;
+	case 8:
+		memcpy( dst, src, w );
+		break;
+	case 16:
+		memcpy( dst, src, w * 2 );
+		break;
+	case 32:
+		if( state->shared->hasBGRA )
+		{
+			memcpy( dst, src, w * 4 );
+		}
+		else
+			RPISwizzleRow( src, dst, w );
+		break;
+	}
+}
+
+// Uploads pPix into t, or just the given bit plane of it as an alpha mask.
+// Only GC tiles and stipples need tile; anything else is drawn within one
+// copy of the pixmap and goes up at its own size, clamped.
+static Bool RPIUploadPixmap( RPIPtr state, RPITexturePtr t, PixmapPtr pPix, unsigned long plane, Bool tile )
+{
+	int w = pPix->drawable.width;
+	int h = pPix->drawable.height;
+	int bpp = pPix->drawable.bitsPerPixel;
+	Bool alpha = bpp <= 8 || plane != 0;
+	GLenum format, type;
+	int Bpp;
+
+	switch( plane != 0 ? 1 : bpp )
+	{
+	case 1:
+	case 8:
+		format = GL_ALPHA;
+		type = GL_UNSIGNED_BYTE;
+		Bpp = 1;
+		break;
+	case 16:
+		format = GL_RGB;
+		type = GL_UNSIGNED_SHORT_5_6_5;
+		Bpp = 2;
+		break;
+	case 32:
+		format = state->shared->hasBGRA ? GL_BGRA_EXT : GL_RGBA;
+		type = GL_UNSIGNED_BYTE;
+		Bpp = 4;
+		break;
+	default:
+		return FALSE;
+	}
+	if( w <= 0 || h <= 0 || pPix->devPrivate.ptr == NULL )
+		return FALSE;
+
+	int texWidth = tile ? RPITileTexSize(w) : RPINextPow2(w);
+	int texHeight = tile ? RPITileTexSize(h) : RPINextPow2(h);
+	int periodW = w * (texWidth / w);
+	int periodH = h * (texHeight / h);
+	if( !tile && (periodW != texWidth || periodH != texHeight) )
+	{
+		periodW = w;
+		periodH = h;
+	}
+	else
+		tile = TRUE;  // a power of two pixmap wraps either way
+
+	if( t->tex == 0 )
+		glGenTextures( 1, &t->tex );
+	glBindTexture( GL_TEXTURE_2D, t->tex );
+	state->shared->boundTex = t->tex;
+	// A way that last held a pixmap in another format is reallocated, or
+	// glTexSubImage2D would fail on it
+	if( t->texWidth != texWidth || t->texHeight != texHeight || t->alpha != alpha ||
+			t->format != format || t->type != type || t->tile != tile )
+	{
+		glTexImage2D( GL_TEXTURE_2D, 0, format, texWidth, texHeight, 0, format, type, NULL );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, tile ? GL_REPEAT : GL_CLAMP_TO_EDGE );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, tile ? GL_REPEAT : GL_CLAMP_TO_EDGE );
+		t->tile = tile;
+		t->texWidth = texWidth;
+		t->texHeight = texHeight;
+		t->format = format;
+		t->type = type;
+	}
+	t->width = periodW;
+	t->height = periodH;
+	t->alpha = alpha;
+
+	// Straight from the pixmap when GL can take its rows as they are
+	if( periodW == w && periodH == h && plane == 0 && (bpp == 8 || bpp == 16 || (bpp == 32 && state->shared->hasBGRA)) &&
+			pPix->devKind == ((w * Bpp + 3) & ~3) )
+	{
+		glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+		glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, w, h, format, type, pPix->devPrivate.ptr );
+		return TRUE;
+	}
+
+	CARD8* buf = RPIScratch( state, (size_t)periodW * periodH * Bpp );
+	if( buf == NULL )
+		return FALSE;
+	const int rowBytes = periodW * Bpp;
+	for( int y = 0; y < periodH; ++y )
+	{
+		CARD8* row = buf + (size_t)y * rowBytes;
+		if( y >= h )
+		{
+			memcpy( row, row - (size_t)h * rowBytes, rowBytes );
+			continue;
+		}
+		RPIConvertRow( state, (const CARD8*)pPix->devPrivate.ptr + y * pPix->devKind, row, w, bpp, plane );
+		for( int x = w; x < periodW; x += w )
+			memcpy( row + x * Bpp, row, w * Bpp );
+	}
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+	glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, periodW, periodH, format, type, buf );
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+	return TRUE;
+}
+
+// Two interleaved 32 bit FNV style lanes over an array of words
+static uint64_t RPIHashWords( const CARD32* p, int words )
+{
+	CARD32 a = 2166136261u, b = 0x9747b28cu;
+	int i = 0;
+
+	for( ; i + 1 < words; i += 2 )
+	{
+		a = (a ^ p[i]) * 16777619u;
+		b = (b ^ p[i + 1]) * 0x5bd1e995u;
+	}
+	if( i < words )
+		a = (a ^ p[i]) * 16777619u;
+	return ((uint64_t)a << 32) | b;
+}
+
+// Finds the GL copy of pPix (or of one bit plane of it), uploading it if
+// it is missing or has been damaged since. tile asks for a copy that can
+// be tiled, see RPIUploadPixmap. hint is the entry the caller used last
+// time, which lets repeated fills skip the set lookup.
+static RPITexturePtr RPITexCacheLookup( RPIPtr state, PixmapPtr pPix, unsigned long plane, Bool tile, RPITexturePtr hint )
+{
+	unsigned long serial = pPix->drawable.serialNumber;
+	RPIPixmapPrivPtr priv = RPIGetPixmapPriv(pPix);
+	unsigned int damage = priv->damage;
+	RPITexturePtr t = NULL;
+
+	// Clients write shm pixmaps behind the server's back, but only between
+	// their requests, and a client waiting on a reply lets the block handler
+	// run first. So a shm pixmap counts as damaged once per dispatch cycle
+	// in which it is used; that costs a full upload, which is what video
+	// changes anyway, and never leaves stale rows behind. Hashing rows to
+	// upload only the changed ones cost more than the upload it saved.
+	if( priv->shm && priv->shmEpoch != state->shared->shmEpoch )
+	{
+		priv->shmEpoch = state->shared->shmEpoch;
+		damage = ++priv->damage;
+	}
+
+	++state->shared->texClock;
+	if( hint != NULL && hint->pPix == pPix && hint->serial == serial && hint->plane == plane )
+		t = hint;
+	else
+	{
+		RPITexturePtr set = &state->shared->texCache[((((uintptr_t)pPix >> 6) ^ serial ^ plane) % RPI_TEX_CACHE_SETS) * RPI_TEX_CACHE_WAYS];
+		RPITexturePtr victim = &set[0];
+		for( int i = 0; i < RPI_TEX_CACHE_WAYS; ++i )
+		{
+			if( set[i].pPix == pPix && set[i].serial == serial && set[i].plane == plane )
+			{
+				t = &set[i];
+				break;
+			}
+			if( victim->pPix != NULL && (set[i].pPix == NULL || set[i].lastUse < victim->lastUse) )
+				victim = &set[i];
+		}
+		if( t == NULL )
+		{
+			t = victim;
+			t->pPix = NULL;
+		}
+	}
+
+	t->lastUse = state->shared->texClock;
+	if( t->pPix == pPix && t->damage == damage && (t->tile || !tile) )
+	{
+		++state->shared->texHits;
+		return t;
+	}
+
+	++state->shared->texMisses;
+	if( !RPIUploadPixmap(state, t, pPix, plane, tile) )
+	{
+		t->pPix = NULL;
+		return NULL;
+	}
+	t->pPix = pPix;
+	t->serial = serial;
+	t->plane = plane;
+	t->damage = damage;
+	return t;
+}
+
+// Drops the cache entries of a pixmap that is going away. The GL texture
+// names are kept for reuse.
+static void RPITexCacheForget( RPIPtr state, PixmapPtr pPix )
+{
+	for( int i = 0; i < RPI_TEX_CACHE_SETS * RPI_TEX_CACHE_WAYS; ++i )
+	{
+		if( state->shared->texCache[i].pPix == pPix )
+			state->shared->texCache[i].pPix = NULL;
+	}
+}
+
+static void RPITexCacheFini( RPIPtr state )
+{
+	for( int i = 0; i < RPI_TEX_CACHE_SETS * RPI_TEX_CACHE_WAYS; ++i )
+	{
+		if( state->shared->texCache[i].tex != 0 )
+			glDeleteTextures( 1, &state->shared->texCache[i].tex );
+	}
+	if( state->shared->upload.tex != 0 )
+		glDeleteTextures( 1, &state->shared->upload.tex );
+	if( state->shared->copy.tex != 0 )
+		glDeleteTextures( 1, &state->shared->copy.tex );
+	memset( state->shared->texCache, 0, sizeof(state->shared->texCache) );
+	memset( &state->shared->upload, 0, sizeof(state->shared->upload) );
+	memset( &state->shared->copy, 0, sizeof(state->shared->copy) );
+	for( int i = 0; i < RPI_RAMPS; ++i )
+	{
+		if( state->shared->ramps[i].tex.tex != 0 )
+			glDeleteTextures( 1, &state->shared->ramps[i].tex.tex );
+	}
+	memset( state->shared->ramps, 0, sizeof(state->shared->ramps) );
+	state->shared->boundTex = 0;
+}
+
+// Applies the logic op, texture and texture program for a fill, touching
+// GL only for what differs from the previous fill
+static void RPIApplyProgram( RPIPtr state, GLenum logicOp, RPITexturePtr tex, RPIFillProgram program )
+{
+	if( logicOp != state->shared->logicOp )
+	{
+		if( logicOp == GL_COPY )
+			glDisable( GL_COLOR_LOGIC_OP );
+		else
+		{
+			glEnable( GL_COLOR_LOGIC_OP );
+			glLogicOp( logicOp );
+		}
+		state->shared->logicOp = logicOp;
+	}
+
+	GLuint name = tex ? tex->tex : 0;
+	if( program != state->shared->program )
+	{
+		if( program == RPI_FILL_SOLID )
+		{
+			glDisable( GL_TEXTURE_2D );
+			glDisableClientState( GL_TEXTURE_COORD_ARRAY );
+		}
+		else
+		{
+			glEnable( GL_TEXTURE_2D );
+			glEnableClientState( GL_TEXTURE_COORD_ARRAY );
+			if( program == RPI_FILL_MASK )
+			{
+				// Premultiplied colour and its alpha both scaled by the mask
+				glTexEnvi( GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_COMBINE );
+				glTexEnvi( GL_TEXTURE_ENV, GL_COMBINE_RGB, GL_MODULATE );
+				glTexEnvi( GL_TEXTURE_ENV, GL_SRC0_RGB, GL_PRIMARY_COLOR );
+				glTexEnvi( GL_TEXTURE_ENV, GL_OPERAND0_RGB, GL_SRC_COLOR );
+				glTexEnvi( GL_TEXTURE_ENV, GL_SRC1_RGB, GL_TEXTURE );
+				glTexEnvi( GL_TEXTURE_ENV, GL_OPERAND1_RGB, GL_SRC_ALPHA );
+				glTexEnvi( GL_TEXTURE_ENV, GL_COMBINE_ALPHA, GL_MODULATE );
+				glTexEnvi( GL_TEXTURE_ENV, GL_SRC0_ALPHA, GL_PRIMARY_COLOR );
+				glTexEnvi( GL_TEXTURE_ENV, GL_SRC1_ALPHA, GL_TEXTURE );
+			}
+			else
+				glTexEnvi( GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, program == RPI_FILL_STIPPLE ? GL_MODULATE : GL_REPLACE );
+		}
+		if( program == RPI_FILL_STIPPLE )
+			glEnable( GL_ALPHA_TEST );
+		else
+			glDisable( GL_ALPHA_TEST );
+		state->shared->program = program;
+	}
+	if( name != 0 && name != state->shared->boundTex )
+	{
+		glBindTexture( GL_TEXTURE_2D, name );
+		state->shared->boundTex = name;
+	}
+}
+
+// Applies the logic op and texture for a GC style fill
+static void RPIApplyFill( RPIPtr state, GLenum logicOp, RPITexturePtr tex )
+{
+	RPIApplyProgram( state, logicOp, tex, tex == NULL ? RPI_FILL_SOLID : tex->alpha ? RPI_FILL_STIPPLE : RPI_FILL_TILE );
+}
+
+// Applies an alpha mask fill that passes the set bits of tex, or the clear
+// ones when clearBits is TRUE
+static void RPIApplyStipple( RPIPtr state, GLenum logicOp, RPITexturePtr tex, Bool clearBits )
+{
+	GLenum func = clearBits ? GL_LESS : GL_GREATER;
+
+	RPIApplyFill( state, logicOp, tex );
+	if( func != state->shared->alphaFunc )
+	{
+		glAlphaFunc( func, 0.5f );
+		state->shared->alphaFunc = func;
+	}
+}
+
+// The stencil buffer does not survive a swap, so it is cleared lazily
+// before the first use in each frame
+static void RPIStencilBegin( RPIPtr state )
+{
+	if( !state->stencilValid )
+	{
+		Bool scissor = glIsEnabled( GL_SCISSOR_TEST );
+		if( scissor )
+			glDisable( GL_SCISSOR_TEST );
+		glStencilMask( 0xff );
+		glClearStencil( 0 );
+		glClear( GL_STENCIL_BUFFER_BIT );
+		if( scissor )
+			glEnable( GL_SCISSOR_TEST );
+		state->stencilValid = TRUE;
+		state->stencilClipSerial = 0;
+		state->stencilClipId = 0;
+	}
+	glEnable( GL_STENCIL_TEST );
+}
+
+typedef struct {
+	GLfloat x, y, s, t;
+} RPIVertex;
+
+#define RPI_BATCH_QUADS 256
+
+typedef struct {
+	RPIVertex* v;
+	int n;
+	Bool textured;
+} RPIBatch;
+
+static void RPIBatchFlush( RPIBatch* b )
+{
+	if( b->n == 0 )
+		return;
+	glEnableClientState( GL_VERTEX_ARRAY );
+	glVertexPointer( 2, GL_FLOAT, sizeof(RPIVertex), &b->v[0].x );
+	if( b->textured )
+		glTexCoordPointer( 2, GL_FLOAT, sizeof(RPIVertex), &b->v[0].s );
+	glDrawArrays( GL_TRIANGLES, 0, b->n );
+	b->n = 0;
+}
+
+static void RPIBatchQuad( RPIBatch* b, GLfloat x1, GLfloat y1, GLfloat x2, GLfloat y2, GLfloat s1, GLfloat t1, GLfloat s2, GLfloat t2 )
+{
+	if( b->n + 6 > RPI_BATCH_QUADS * 6 )
+		RPIBatchFlush(b);
+	RPIVertex* v = &b->v[b->n];
+	v[0] = (RPIVertex){ x1, y1, s1, t1 };
+	v[1] = (RPIVertex){ x2, y1, s2, t1 };
+	v[2] = (RPIVertex){ x1, y2, s1, t2 };
+	v[3] = (RPIVertex){ x2, y1, s2, t1 };
+	v[4] = (RPIVertex){ x2, y2, s2, t2 };
+	v[5] = (RPIVertex){ x1, y2, s1, t2 };
+	b->n += 6;
+}
+
+static int RPIMod( int a, int m )
+{
+	a %= m;
+	return a < 0 ? a + m : a;
+}
+
+// Emits one box, splitting it at tile period boundaries when the period
+// does not fill the texture and GL_REPEAT cannot do the wrapping
+static void RPIBatchBox( RPIBatch* b, const BoxRec* box, RPITexturePtr tex, int orgX, int orgY )
+{
+	if( tex == NULL )
+	{
+		RPIBatchQuad( b, box->x1, box->y1, box->x2, box->y2, 0, 0, 0, 0 );
+		return;
+	}
+
+	const GLfloat sw = 1.0f / tex->texWidth;
+	const GLfloat sh = 1.0f / tex->texHeight;
+	if( tex->width == tex->texWidth && tex->height == tex->texHeight )
+	{
+		RPIBatchQuad( b, box->x1, box->y1, box->x2, box->y2,
+				(box->x1 - orgX) * sw, (box->y1 - orgY) * sh, (box->x2 - orgX) * sw, (box->y2 - orgY) * sh );
+		return;
+	}
+
+	for( int y = box->y1, ny; y < box->y2; y = ny )
+	{
+		int ty = RPIMod( y - orgY, tex->height );
+		ny = min( (int)box->y2, y + tex->height - ty );
+		for( int x = box->x1, nx; x < box->x2; x = nx )
+		{
+			int tx = RPIMod( x - orgX, tex->width );
+			nx = min( (int)box->x2, x + tex->width - tx );
+			RPIBatchQuad( b, x, y, nx, ny, tx * sw, ty * sh, (tx + nx - x) * sw, (ty + ny - y) * sh );
+		}
+	}
+}
+
+// Fills boxes (screen coordinates) with the currently applied fill state.
+// clip is the region to intersect them with on the CPU, or NULL when the
+// clip engine is already clipping on the GPU.
+static void RPIFillBoxes( RPIPtr state, RegionPtr clip, const BoxRec* boxes, int nBoxes, RPITexturePtr tex, int orgX, int orgY )
+{
+	RPIBatch batch;
+
+	batch.v = RPIScratch( state, sizeof(RPIVertex) * RPI_BATCH_QUADS * 6 );
+	batch.n = 0;
+	batch.textured = tex != NULL;
+	if( batch.v == NULL )
+		return;
+
+	if( clip == NULL )
+	{
+		for( int i = 0; i < nBoxes; ++i )
+			RPIBatchBox( &batch, &boxes[i], tex, orgX, orgY );
+		RPIBatchFlush( &batch );
+		return;
+	}
+
+	BoxPtr pClip = RegionRects(clip);
+	int nClip = RegionNumRects(clip);
+	for( int i = 0; i < nBoxes; ++i )
+	{
+		const BoxRec* box = &boxes[i];
+		for( int c = 0; c < nClip; ++c )
+		{
+			// clip boxes are banded in y
+			if( pClip[c].y2 <= box->y1 )
+				continue;
+			if( pClip[c].y1 >= box->y2 )
+				break;
+			BoxRec part;
+			part.x1 = max( box->x1, pClip[c].x1 );
+			part.x2 = min( box->x2, pClip[c].x2 );
+			part.y1 = max( box->y1, pClip[c].y1 );
+			part.y2 = min( box->y2, pClip[c].y2 );
+			if( part.x1 < part.x2 && part.y1 < part.y2 )
+				RPIBatchBox( &batch, &part, tex, orgX, orgY );
+		}
+	}
+	RPIBatchFlush( &batch );
+}
+
+// Clip lists up to this many boxes are intersected with the geometry on
+// the CPU; longer ones go to the stencil buffer
+#define RPI_CLIP_CPU_BOXES 8
+
+static unsigned long RPIClipSerial = 0;
+
+// Sets up clipping to the GC's composite clip for the next draws. A single
+// box becomes the scissor rectangle, a short list is returned in cpuClip
+// for RPIFillBoxes to intersect with, and anything longer is drawn into
+// the low stencil bits once and reused for as long as the clip does not
+// change. Returns FALSE when nothing is visible.
+static Bool RPIClipBegin( RPIPtr state, GCPtr pGC, RegionPtr* cpuClip )
+{
+	RegionPtr clip = pGC->pCompositeClip;
+	RPIGCPrivPtr priv = RPIGetGCPriv(pGC);
+	int nClip = RegionNumRects(clip);
+
+	*cpuClip = NULL;
+	state->clipRef = 0;
+	state->clipMask = 0;
+	if( nClip == 0 )
+		return FALSE;
+
+	if( nClip == 1 )
+	{
+		BoxPtr b = RegionExtents(clip);
+		glEnable( GL_SCISSOR_TEST );
+		glScissor( b->x1, state->height - b->y2, b->x2 - b->x1, b->y2 - b->y1 );
+		return TRUE;
+	}
+
+	if( nClip <= RPI_CLIP_CPU_BOXES )
+	{
+		*cpuClip = clip;
+		return TRUE;
+	}
+
+	RPIStencilBegin( state );
+	if( state->stencilClipSerial != priv->clipSerial )
+	{
+		// Each clip gets its own id, so older clips left in the stencil
+		// never match. Only running out of ids needs a clear.
+		glStencilMask( 0x7f );
+		if( ++state->stencilClipId > 0x7f )
+		{
+			glClearStencil( 0 );
+			glClear( GL_STENCIL_BUFFER_BIT );
+			state->stencilClipId = 1;
+		}
+		glColorMask( GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE );
+		glStencilFunc( GL_ALWAYS, state->stencilClipId, 0x7f );
+		glStencilOp( GL_KEEP, GL_KEEP, GL_REPLACE );
+		RPIApplyFill( state, GL_COPY, NULL );
+		RPIFillBoxes( state, NULL, RegionRects(clip), nClip, NULL, 0, 0 );
+		glColorMask( GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE );
+		state->stencilClipSerial = priv->clipSerial;
+	}
+	glStencilMask( 0 );
+	glStencilFunc( GL_EQUAL, state->stencilClipId, 0x7f );
+	glStencilOp( GL_KEEP, GL_KEEP, GL_KEEP );
+	state->clipRef = state->stencilClipId;
+	state->clipMask = 0x7f;
+	return TRUE;
+}
+
+static void RPIClipEnd( RPIPtr state )
+{
+	glDisable( GL_SCISSOR_TEST );
+	glDisable( GL_STENCIL_TEST );
+	glStencilMask( 0xff );
+}
+
+// Fills boxes (screen coordinates) with fb on a read back copy of their
+// extents, for tiles and stipples GL cannot take, such as ones larger
+// than the maximum texture size
+static void RPIFillSoftware( RPIPtr state, DrawablePtr pDraw, GCPtr pGC, RegionPtr clip, const BoxRec* boxes, int nBoxes )
+{
+	BoxPtr clipExt = RegionExtents(pGC->pCompositeClip);
+	BoxRec ext = boxes[0];
+
+	for( int i = 1; i < nBoxes; ++i )
+	{
+		ext.x1 = min( ext.x1, boxes[i].x1 );
+		ext.y1 = min( ext.y1, boxes[i].y1 );
+		ext.x2 = max( ext.x2, boxes[i].x2 );
+		ext.y2 = max( ext.y2, boxes[i].y2 );
+	}
+	ext.x1 = max( max(ext.x1, clipExt->x1), 0 );
+	ext.y1 = max( max(ext.y1, clipExt->y1), 0 );
+	ext.x2 = min( min(ext.x2, clipExt->x2), state->width );
+	ext.y2 = min( min(ext.y2, clipExt->y2), state->height );
+	if( ext.x1 >= ext.x2 || ext.y1 >= ext.y2 )
+		return;
+
+	ScreenPtr pScreen = pDraw->pScreen;
+	int w = ext.x2 - ext.x1;
+	int h = ext.y2 - ext.y1;
+	PixmapPtr pPix = pScreen->CreatePixmap( pScreen, w, h, pDraw->depth, 0 );
+	if( pPix == NullPixmap )
+		return;
+	if( RPIReadPixels(state, ext.x1, ext.y1, w, h, pPix->devPrivate.ptr, pPix->devKind) )
+	{
+		// fb takes the pattern origin relative to the drawable it fills
+		DDXPointRec patOrg = pGC->patOrg;
+		pGC->patOrg.x += pDraw->x - ext.x1;
+		pGC->patOrg.y += pDraw->y - ext.y1;
+		for( int i = 0; i < nBoxes; ++i )
+		{
+			int x1 = max( (int)boxes[i].x1, (int)ext.x1 );
+			int y1 = max( (int)boxes[i].y1, (int)ext.y1 );
+			int x2 = min( (int)boxes[i].x2, (int)ext.x2 );
+			int y2 = min( (int)boxes[i].y2, (int)ext.y2 );
+			if( x1 < x2 && y1 < y2 )
+				fbFill( &pPix->drawable, pGC, x1 - ext.x1, y1 - ext.y1, x2 - x1, y2 - y1 );
+		}
+		pGC->patOrg = patOrg;
+
+		RPITexturePtr t = RPITexCacheLookup( state, pPix, 0, FALSE, NULL );
+		if( t != NULL )
+		{
+			RPIApplyFill( state, GL_COPY, t );
+			RPIFillBoxes( state, clip, boxes, nBoxes, t, ext.x1, ext.y1 );
+		}
+	}
+	pScreen->DestroyPixmap( pPix );
+}
+
+// Fills boxes (screen coordinates) using the GC's fill style, inside the
+// clip set up by RPIClipBegin
+static void RPIFillGC( RPIPtr state, DrawablePtr pDraw, GCPtr pGC, RegionPtr clip, const BoxRec* boxes, int nBoxes )
+{
+	RPIGCPrivPtr priv = RPIGetGCPriv(pGC);
+	RPITexturePtr tex = NULL;
+	int orgX = pDraw->x + pGC->patOrg.x;
+	int orgY = pDraw->y + pGC->patOrg.y;
+
+	if( priv->program != RPI_FILL_SOLID )
+	{
+		tex = RPITexCacheLookup( state, priv->fillPixmap, 0, TRUE, priv->fillTex );
+		priv->fillTex = tex;
+		if( tex == NULL )
+		{
+			RPIFillSoftware( state, pDraw, pGC, clip, boxes, nBoxes );
+			return;
+		}
+	}
+
+	if( tex == NULL )
+	{
+		RPIApplyFill( state, priv->logicOp, NULL );
+		glColor4f( priv->fill[0], priv->fill[1], priv->fill[2], priv->fill[3] );
+		RPIFillBoxes( state, clip, boxes, nBoxes, NULL, 0, 0 );
+		return;
+	}
+
+	if( priv->program == RPI_FILL_OPAQUE_STIPPLE )
+	{
+		// Background goes only where the stipple is clear so that each
+		// pixel sees the logic op once
+		RPIApplyStipple( state, priv->logicOp, tex, TRUE );
+		glColor4f( priv->bg[0], priv->bg[1], priv->bg[2], priv->bg[3] );
+		RPIFillBoxes( state, clip, boxes, nBoxes, tex, orgX, orgY );
+	}
+	RPIApplyStipple( state, priv->logicOp, tex, FALSE );
+	glColor4f( priv->fg[0], priv->fg[1], priv->fg[2], priv->fg[3] );
+	RPIFillBoxes( state, clip, boxes, nBoxes, tex, orgX, orgY );
+}
+
+// Paints the queued window backgrounds, one batch per colour or tile
+static void RPIFlushBackgrounds( RPIPtr state )
+{
+	state->dirty = TRUE;
+	for( int i = 0; i < state->nBackgrounds; ++i )
+	{
+		RPIBackground* bg = &state->backgrounds[i];
+		RPITexturePtr tex = NULL;
+
+		if( state->restoring )
+			RPIRestoreArea( state, RegionExtents(&bg->region) );
+		if( bg->tile != NULL )
+			tex = RPITexCacheLookup( state, bg->tile, 0, TRUE, NULL );
+		if( bg->tile == NULL || tex != NULL )
+		{
+			RPIApplyFill( state, GL_COPY, tex );
+			if( tex == NULL )
+				glColor4f( bg->color[0], bg->color[1], bg->color[2], bg->color[3] );
+			RPIFillBoxes( state, NULL, RegionRects(&bg->region), RegionNumRects(&bg->region), tex, bg->orgX, bg->orgY );
+		}
+		RegionUninit( &bg->region );
+		if( bg->tile != NULL )
+			bg->tile->drawable.pScreen->DestroyPixmap( bg->tile );
+	}
+	state->nBackgrounds = 0;
+}
+
+// Drops the queued backgrounds unpainted
+static void RPIBackgroundsFini( RPIPtr state )
+{
+	for( int i = 0; i < state->nBackgrounds; ++i )
+	{
+		RegionUninit( &state->backgrounds[i].region );
+		if( state->backgrounds[i].tile != NULL )
+			state->backgrounds[i].tile->drawable.pScreen->DestroyPixmap( state->backgrounds[i].tile );
+	}
+	state->nBackgrounds = 0;
 }
 
-Bool RPIEnterVT( int, int );
-
-Bool RPIStartGL( RPIPtr state )
+// Loads client image data into the streaming texture t. Images at the
+// screen depth go up as they are where GL allows; bitmaps (bpp 1) are
+// expanded to GL_ALPHA.
+static Bool RPIUploadImage( RPIPtr state, RPITexturePtr t, const CARD8* bits, int stride, int w, int h, int bpp )
 {
-	bcm_host_init();
-	EGLConfig config;
-	EGLBoolean result;
-	EGLint num_config;
+	GLenum format = GL_ALPHA, type = GL_UNSIGNED_BYTE;
+	int Bpp = 1;
 
-	static const EGLint attribute_list[] =
+	if( bpp == 16 )
 	{
-		EGL_RED_SIZE, 8,
-		EGL_GREEN_SIZE, 8,
-		EGL_BLUE_SIZE, 8,
-		EGL_ALPHA_SIZE, 8,
-		EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
-		EGL_NONE
-	};
+		format = GL_RGB;
+		type = GL_UNSIGNED_SHORT_5_6_5;
+		Bpp = 2;
+	}
+	else if( bpp == 32 )
+	{
+		format = state->shared->hasBGRA ? GL_BGRA_EXT : GL_RGBA;
+		Bpp = 4;
+	}
 
-	static const EGLint context_attributes[] = 
+	if( t->tex == 0 )
+		glGenTextures( 1, &t->tex );
+	glBindTexture( GL_TEXTURE_2D, t->tex );
+	state->shared->boundTex = t->tex;
+	// Grow only, so a stream of similar images reuses one allocation
+	if( t->texWidth < w || t->texHeight < h || t->alpha != (bpp == 1) || t->format != format || t->type != type )
 	{
-		EGL_CONTEXT_CLIENT_VERSION, 1,
-		EGL_NONE
-	};
+		t->texWidth = max( t->texWidth, RPINextPow2(w) );
+		t->texHeight = max( t->texHeight, RPINextPow2(h) );
+		t->format = format;
+		t->type = type;
+		glTexImage2D( GL_TEXTURE_2D, 0, format, t->texWidth, t->texHeight, 0, format, type, NULL );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	}
+	t->width = t->texWidth;
+	t->height = t->texHeight;
+	t->alpha = bpp == 1;
 
-	// get an EGL display connection
-	state->display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
-	assert(state->display!=EGL_NO_DISPLAY);
+	if( bpp != 1 && (bpp == 16 || state->shared->hasBGRA) && stride == ((w * Bpp + 3) & ~3) )
+	{
+		glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+		glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, w, h, format, type, bits );
+		return TRUE;
+	}
 
-	// initialize the EGL display connection
-	result = eglInitialize(state->display, NULL, NULL);
-	assert(EGL_FALSE != result);
+	CARD8* buf = RPIScratch( state, (size_t)w * h * Bpp );
+	if( buf == NULL )
+		return FALSE;
+	for( int y = 0; y < h; ++y )
+		RPIConvertRow( state, bits + y * stride, buf + (size_t)y * w * Bpp, w, bpp, 0 );
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+	glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, w, h, format, type, buf );
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+	return TRUE;
+}
 
-	// get an appropriate EGL frame buffer configuration
-	result = eglChooseConfig(state->display, attribute_list, &config, 1, &num_config);
-	assert(EGL_FALSE != result);
-	printConfig(state->display,config);
+// Draws a w x h image whose first row is at bits into the window at x,y
+// through the streaming texture. bpp 1 is a bitmap in the GC's colours,
+// starting leftpad bits into each row; anything else is at the drawable's
+// depth.
+static void RPIDrawImage( RPIPtr state, DrawablePtr pDraw, GCPtr pGC, int x, int y, int w, int h, int leftpad, int bpp, const CARD8* bits, int stride )
+{
+	RPIGCPrivPtr priv = RPIGetGCPriv(pGC);
+	RPITexturePtr t = &state->shared->upload;
+	RegionPtr clip;
+
+	// Bitmaps are uploaded including the left pad, which is then skipped
+	// through the texture origin
+	if( !RPIUploadImage(state, t, bits, stride, w + leftpad, h, bpp) || !RPIClipBegin(state, pGC, &clip) )
+		return;
+
+	BoxRec box;
+	box.x1 = pDraw->x + x;
+	box.y1 = pDraw->y + y;
+	box.x2 = box.x1 + w;
+	box.y2 = box.y1 + h;
+	if( bpp == 1 )
+	{
+		RPIApplyStipple( state, priv->logicOp, t, TRUE );
+		glColor4f( priv->bg[0], priv->bg[1], priv->bg[2], priv->bg[3] );
+		RPIFillBoxes( state, clip, &box, 1, t, box.x1 - leftpad, box.y1 );
+		RPIApplyStipple( state, priv->logicOp, t, FALSE );
+		glColor4f( priv->fg[0], priv->fg[1], priv->fg[2], priv->fg[3] );
+	}
+	else
+		RPIApplyFill( state, priv->logicOp, t );
+	RPIFillBoxes( state, clip, &box, 1, t, box.x1 - leftpad, box.y1 );
+	RPIClipEnd( state );
+}
 
-	// get an appropriate EGL frame buffer configuration
-	//   result = eglBindAPI(EGL_OPENGL_ES_API);
-	//   assert(EGL_FALSE != result);
-	//   check();
+// Rows of the screen moved per band by RPICopyScreenRegion
+#define RPI_COPY_BAND 128
 
-	// create an EGL rendering context
-	state->context = eglCreateContext(state->display, config, EGL_NO_CONTEXT, 0);
-// context_attributes);
-	if( state->context == EGL_NO_CONTEXT )
+// Fills every box of dst (screen coordinates) with the screen pixels dx,dy
+// away from it. GLES 1.1 cannot blit within the framebuffer, so the source
+// goes through a texture a band at a time, ordered like memmove so that a
+// band is read before an overlapping one lands on it.
+static void RPICopyScreenRegion( RPIPtr state, GLenum logicOp, RegionPtr dst, int dx, int dy )
+{
+	RPITexturePtr t = &state->shared->copy;
+	RPIBatch batch;
+
+	// Only what has a source on the screen can be copied
+	BoxRec valid = { max(dx, 0), max(dy, 0), state->width + min(dx, 0), state->height + min(dy, 0) };
+	RegionRec validRgn;
+	RegionInit( &validRgn, &valid, 1 );
+	RegionIntersect( dst, dst, &validRgn );
+	RegionUninit( &validRgn );
+	if( !RegionNotEmpty(dst) )
+		return;
+
+	BoxPtr ext = RegionExtents(dst);
+	int w = ext->x2 - ext->x1;
+	GLenum format = state->depth == 16 ? GL_RGB : GL_RGBA;
+
+	// The source may lie outside the window being drawn to
+	if( state->restoring )
 	{
-		ErrorF("No context!\n");
-		return FALSE;
-	} else
+		BoxRec src = { ext->x1 - dx, ext->y1 - dy, ext->x2 - dx, ext->y2 - dy };
+		RPIRestoreArea( state, &src );
+	}
+	GLenum type = state->depth == 16 ? GL_UNSIGNED_SHORT_5_6_5 : GL_UNSIGNED_BYTE;
+
+	if( t->tex == 0 )
+		glGenTextures( 1, &t->tex );
+	glBindTexture( GL_TEXTURE_2D, t->tex );
+	state->shared->boundTex = t->tex;
+	if( t->texWidth < w || t->texHeight != RPI_COPY_BAND || t->format != format || t->type != type )
 	{
-		ErrorF("Context get! %p\n", state->context);
+		t->texWidth = max( t->texWidth, RPINextPow2(w) );
+		t->texHeight = RPI_COPY_BAND;
+		t->format = format;
+		t->type = type;
+		glTexImage2D( GL_TEXTURE_2D, 0, format, t->texWidth, t->texHeight, 0, format, type, NULL );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	}
+	t->width = t->texWidth;
+	t->height = t->texHeight;
+	t->alpha = FALSE;
+	RPIApplyFill( state, logicOp, t );
+
+	batch.v = RPIScratch( state, sizeof(RPIVertex) * RPI_BATCH_QUADS * 6 );
+	batch.n = 0;
+	batch.textured = TRUE;
+	if( batch.v == NULL )
+		return;
+
+	const GLfloat sw = 1.0f / t->texWidth;
+	const GLfloat sh = 1.0f / t->texHeight;
+	const BoxRec* boxes = RegionRects(dst);
+	int nBoxes = RegionNumRects(dst);
+	int nBands = (ext->y2 - ext->y1 + RPI_COPY_BAND - 1) / RPI_COPY_BAND;
+	for( int i = 0; i < nBands; ++i )
+	{
+		// Moving down, the bottom band goes first
+		int y1 = ext->y1 + (dy > 0 ? nBands - 1 - i : i) * RPI_COPY_BAND;
+		int y2 = min( y1 + RPI_COPY_BAND, (int)ext->y2 );
+		int sx = ext->x1 - dx;
+		int sy2 = y2 - dy;
+
+		// Texture rows run bottom up from source row sy2 - 1
+		glCopyTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, sx, state->height - sy2, w, y2 - y1 );
+		for( int b = 0; b < nBoxes; ++b )
+		{
+			int by1 = max( (int)boxes[b].y1, y1 );
+			int by2 = min( (int)boxes[b].y2, y2 );
+			if( by1 >= by2 )
+				continue;
+			RPIBatchQuad( &batch, boxes[b].x1, by1, boxes[b].x2, by2,
+					(boxes[b].x1 - ext->x1) * sw, (y2 - by1) * sh, (boxes[b].x2 - ext->x1) * sw, (y2 - by2) * sh );
+		}
+		RPIBatchFlush( &batch );
 	}
-	assert(state->context!=EGL_NO_CONTEXT);
+}
 
-	int bpp;
-	eglGetConfigAttrib(state->display,config,EGL_BUFFER_SIZE,&bpp);
-	graphics_get_display_size(0, &state->width, &state->height );	
-  state->surface = RPICreateGLSurface(state->width, state->height, state->display, config );
-  assert( state->surface != EGL_NO_SURFACE );
+void RPIPutImage( DrawablePtr pDraw, GCPtr pGC, int depth, int x, int y, int w, int h, int leftpad, int format, char* pBits )
+{
+	RPIPtr state = RPIDrawableState(pDraw);
 
-  result = eglMakeCurrent( state->display, state->surface, state->surface, state->context );
-  assert( EGL_FALSE != result);
-  RPIEnterVT(0,0);
-  return TRUE;
+	if( !RPIPrepareDraw(state, pDraw) )
+	{
+		fbPutImage(pDraw, pGC, depth, x, y, w, h, leftpad, format, pBits);
+		RPIPixmapDamage(pDraw);
+		return;
+	}
+	if( w <= 0 || h <= 0 )
+		return;
+
+	// MIT-SHM images arrive here straight from the segment when whole rows
+	// are put, so they are uploaded without an intermediate copy
+	if( format == XYBitmap )
+		RPIDrawImage( state, pDraw, pGC, x, y, w, h, leftpad, 1, (CARD8*)pBits, BitmapBytePad(w + leftpad) );
+	else if( format == ZPixmap && depth == pDraw->depth )
+		RPIDrawImage( state, pDraw, pGC, x, y, w, h, 0, pDraw->bitsPerPixel, (CARD8*)pBits, PixmapBytePad(w, depth) );
+	else
+	{
+		// XYPixmap: fb assembles the planes into a temporary pixmap, which
+		// then goes up like a ZPixmap through the client's GC
+		ScreenPtr pScreen = pDraw->pScreen;
+		PixmapPtr pPix = pScreen->CreatePixmap( pScreen, w, h, pDraw->depth, 0 );
+		GCPtr pTmpGC = GetScratchGC( pDraw->depth, pScreen );
+		if( pPix != NullPixmap && pTmpGC != NULL )
+		{
+			ValidateGC( &pPix->drawable, pTmpGC );
+			fbPutImage( &pPix->drawable, pTmpGC, depth, 0, 0, w, h, leftpad, format, pBits );
+			RPIDrawImage( state, pDraw, pGC, x, y, w, h, 0, pDraw->bitsPerPixel, pPix->devPrivate.ptr, pPix->devKind );
+		}
+		if( pTmpGC != NULL )
+			FreeScratchGC( pTmpGC );
+		if( pPix != NullPixmap )
+			pScreen->DestroyPixmap( pPix );
+	}
 }
 
-static Bool RPIPreInit(ScrnInfoPtr pScrn,int flags)
-{
-	ErrorF("Start PreInit\n");
+RegionPtr RPICopyPlane( DrawablePtr pSrc, DrawablePtr pDest, GCPtr pGC, int srcx, int srcy, int w, int h, int destx, int desty, unsigned long plane );
 
-	pScrn->monitor = pScrn->confScreen->monitor;
+// Copies from an on screen window where the GPU cannot draw straight from
+// it: what the window shows of the area, as miDoCopy takes it, is read back
+// into a temporary pixmap and copied from there a box at a time. The rest
+// is left to the graphics exposures.
+static RegionPtr RPICopyFromScreen( DrawablePtr pSrc, DrawablePtr pDest, GCPtr pGC, int srcx, int srcy, int w, int h,
+		int destx, int desty, unsigned long plane )
+{
+	RPIPtr state = RPIDrawableState(pSrc);
+	ScreenPtr pScreen = pSrc->pScreen;
+	WindowPtr pWin = (WindowPtr)pSrc;
+	BoxRec area = { pSrc->x + srcx, pSrc->y + srcy, pSrc->x + srcx + w, pSrc->y + srcy + h };
+	RegionRec rgn;
+
+	RegionInit( &rgn, &area, 1 );
+	RegionIntersect( &rgn, &rgn, pGC->subWindowMode == IncludeInferiors ? &pWin->borderClip : &pWin->clipList );
+	if( RegionNotEmpty(&rgn) )
+	{
+		BoxPtr ext = RegionExtents(&rgn);
+		PixmapPtr pPix = pScreen->CreatePixmap( pScreen, ext->x2 - ext->x1, ext->y2 - ext->y1, pSrc->depth, 0 );
+		if( pPix != NullPixmap && RPIReadPixels(state, ext->x1, ext->y1, ext->x2 - ext->x1, ext->y2 - ext->y1,
+				pPix->devPrivate.ptr, pPix->devKind) )
+		{
+			const BoxRec* boxes = RegionRects(&rgn);
+			for( int i = 0; i < RegionNumRects(&rgn); ++i )
+			{
+				int sx = boxes[i].x1 - ext->x1;
+				int sy = boxes[i].y1 - ext->y1;
+				int bw = boxes[i].x2 - boxes[i].x1;
+				int bh = boxes[i].y2 - boxes[i].y1;
+				int dx = destx + boxes[i].x1 - area.x1;
+				int dy = desty + boxes[i].y1 - area.y1;
+				RegionPtr exposed = plane != 0 ?
+						RPICopyPlane( &pPix->drawable, pDest, pGC, sx, sy, bw, bh, dx, dy, plane ) :
+						RPICopyArea( &pPix->drawable, pDest, pGC, sx, sy, bw, bh, dx, dy );
+				if( exposed != NULL )
+					RegionDestroy( exposed );
+			}
+		}
+		if( pPix != NullPixmap )
+			pScreen->DestroyPixmap( pPix );
+	}
+	RegionUninit( &rgn );
+	return miHandleExposures(pSrc, pDest, pGC, srcx, srcy, w, h, destx, desty, plane);
+}
 
-	RPIGetRec(pScrn);
+RegionPtr RPICopyArea( DrawablePtr pSrc, DrawablePtr pDest, GCPtr pGC, int srcx, int srcy, int w, int h, int destx, int desty )
+{
+	RPIPtr state = RPIDrawableState(pDest);
 
-  if( !xf86SetDepthBpp(pScrn,0,0,32,0) )
+	// With the surface released for a VT switch the screen is the shadow,
+	// which fb copies like any other pixmap
+	if( state->released || (!RPIOnScreen(pSrc) && !RPIOnScreen(pDest)) )
 	{
-		goto fail;
+		RegionPtr exposed = fbCopyArea(pSrc, pDest, pGC, srcx, srcy, w, h, destx, desty);
+		RPIPixmapDamage(pDest);
+		return exposed;
 	}
-	
-	rgb c;
-	c.red = 0;
-	c.green = 0;
-	c.blue = 0;
-	if( !xf86SetWeight(pScrn,c,c) )
+	if( RPIOnScreen(pSrc) && RPIOnScreen(pDest) && RPIPrepareDraw(state, pDest) )
 	{
-		goto fail;
+		// Within the screen: the destination area inside the clip, less
+		// whatever the source window does not show, as in miDoCopy. The
+		// rest is left to the graphics exposures below.
+		WindowPtr pSrcWin = (WindowPtr)pSrc;
+		BoxRec dst = { pDest->x + destx, pDest->y + desty, pDest->x + destx + w, pDest->y + desty + h };
+		int dx = dst.x1 - (pSrc->x + srcx);
+		int dy = dst.y1 - (pSrc->y + srcy);
+		RegionRec rgn, srcRgn;
+		RegionInit( &rgn, &dst, 1 );
+		RegionIntersect( &rgn, &rgn, pGC->pCompositeClip );
+		RegionNull( &srcRgn );
+		RegionCopy( &srcRgn, pGC->subWindowMode == IncludeInferiors ? &pSrcWin->borderClip : &pSrcWin->clipList );
+		RegionTranslate( &srcRgn, dx, dy );
+		RegionIntersect( &rgn, &rgn, &srcRgn );
+		RegionUninit( &srcRgn );
+		RPICopyScreenRegion( state, RPIGetGCPriv(pGC)->logicOp, &rgn, dx, dy );
+		RegionUninit( &rgn );
+		return miHandleExposures(pSrc, pDest, pGC, srcx, srcy, w, h, destx, desty, 0);
 	}
-
-	Gamma g;
-	g.red = 0;
-	g.green = 0;
-	g.blue = 0;
-	if( !xf86SetGamma(pScrn,g) )
+	if( RPIOnScreen(pSrc) && !RPIOnScreen(pDest) )
+		return RPICopyFromScreen( pSrc, pDest, pGC, srcx, srcy, w, h, destx, desty, 0 );
+	if( RPIOnScreen(pSrc) || pSrc->bitsPerPixel != pDest->bitsPerPixel || !RPIPrepareDraw(state, pDest) )
 	{
-		goto fail;
+		ErrorF("RPICopyArea\n");
+		return NULL;
 	}
 
-	// Should be auto-detecting TrueColor, doesn't...
-	if( !xf86SetDefaultVisual(pScrn, TrueColor) )
+	// Pixmap or redirected window to window, clipped to the source as in
+	// RPICopyPlane
+	int xoff, yoff;
+	PixmapPtr pPix = RPIDrawablePixmap( pSrc, &xoff, &yoff );
+	BoxRec box;
+	box.x1 = max( srcx, 0 );
+	box.y1 = max( srcy, 0 );
+	box.x2 = min( srcx + w, (int)pSrc->width );
+	box.y2 = min( srcy + h, (int)pSrc->height );
+	if( box.x1 < box.x2 && box.y1 < box.y2 )
 	{
-		goto fail;
+		int bw = box.x2 - box.x1;
+		int bh = box.y2 - box.y1;
+
+		// A small part of a pixmap goes up on its own, straight from a shm
+		// segment too; larger copies go through the texture cache
+		if( (long)bw * bh * 4 < (long)pPix->drawable.width * pPix->drawable.height )
+		{
+			const CARD8* bits = (const CARD8*)pPix->devPrivate.ptr + (box.y1 + yoff) * pPix->devKind + (box.x1 + xoff) * (pSrc->bitsPerPixel / 8);
+			RPIDrawImage( state, pDest, pGC, destx + box.x1 - srcx, desty + box.y1 - srcy, bw, bh, 0,
+					pSrc->bitsPerPixel, bits, pPix->devKind );
+		}
+		else
+		{
+			RPIGCPrivPtr priv = RPIGetGCPriv(pGC);
+			RPITexturePtr t = RPITexCacheLookup( state, pPix, 0, FALSE, NULL );
+			int orgX = pDest->x + destx - srcx - xoff;
+			int orgY = pDest->y + desty - srcy - yoff;
+			RegionPtr clip;
+
+			box.x1 += orgX + xoff;
+			box.x2 += orgX + xoff;
+			box.y1 += orgY + yoff;
+			box.y2 += orgY + yoff;
+			if( t != NULL && RPIClipBegin(state, pGC, &clip) )
+			{
+				RPIApplyFill( state, priv->logicOp, t );
+				RPIFillBoxes( state, clip, &box, 1, t, orgX, orgY );
+				RPIClipEnd( state );
+			}
+		}
 	}
+	return miHandleExposures(pSrc, pDest, pGC, srcx, srcy, w, h, destx, desty, 0);
+}
 
-	pScrn->currentMode = calloc(1,sizeof(DisplayModeRec));
-	graphics_get_display_size(0, &pScrn->currentMode->HDisplay, &pScrn->currentMode->VDisplay );	
-  pScrn->zoomLocked = TRUE;
-	pScrn->modes = xf86ModesAdd(pScrn->modes,pScrn->currentMode);
-	//	intel_glamor_pre_init(pScrn);	
+RegionPtr RPICopyPlane( DrawablePtr pSrc, DrawablePtr pDest, GCPtr pGC, int srcx, int srcy, int w, int h, int destx, int desty, unsigned long plane )
+{
+	RPIPtr state = RPIDrawableState(pDest);
 
-	RPIPtr state = RPIPTR(pScrn);
-  RPIStartGL(state);
- 
-  ErrorF("PreInit Success\n");
-	return TRUE;
+	if( state->released || (!RPIOnScreen(pSrc) && !RPIOnScreen(pDest)) )
+	{
+		RegionPtr exposed = fbCopyPlane(pSrc, pDest, pGC, srcx, srcy, w, h, destx, desty, plane);
+		RPIPixmapDamage(pDest);
+		return exposed;
+	}
+	if( RPIOnScreen(pSrc) )
+		return RPICopyFromScreen( pSrc, pDest, pGC, srcx, srcy, w, h, destx, desty, plane );
+	if( !RPIPrepareDraw(state, pDest) )
+	{
+		ErrorF("RPICopyPlane\n");
+		return NULL;
+	}
 
-fail:
-	ErrorF("PreInit Failed\n");
-	RPIFreeRec(pScrn);
-	return FALSE;
+	// Only the part of the source inside the drawable is copied, the rest
+	// is reported through graphics exposures below
+	int xoff, yoff;
+	PixmapPtr pPix = RPIDrawablePixmap( pSrc, &xoff, &yoff );
+	BoxRec box;
+	box.x1 = max( srcx, 0 );
+	box.y1 = max( srcy, 0 );
+	box.x2 = min( srcx + w, (int)pSrc->width );
+	box.y2 = min( srcy + h, (int)pSrc->height );
+	if( box.x1 < box.x2 && box.y1 < box.y2 )
+	{
+		RPIGCPrivPtr priv = RPIGetGCPriv(pGC);
+		RPITexturePtr mask = RPITexCacheLookup( state, pPix, pSrc->depth == 1 ? 0 : plane, FALSE, NULL );
+		int orgX = pDest->x + destx - srcx - xoff;
+		int orgY = pDest->y + desty - srcy - yoff;
+
+		box.x1 += orgX + xoff;
+		box.x2 += orgX + xoff;
+		box.y1 += orgY + yoff;
+		box.y2 += orgY + yoff;
+		RegionPtr clip;
+		if( mask != NULL && RPIClipBegin(state, pGC, &clip) )
+		{
+			RPIApplyStipple( state, priv->logicOp, mask, TRUE );
+			glColor4f( priv->bg[0], priv->bg[1], priv->bg[2], priv->bg[3] );
+			RPIFillBoxes( state, clip, &box, 1, mask, orgX, orgY );
+			RPIApplyStipple( state, priv->logicOp, mask, FALSE );
+			glColor4f( priv->fg[0], priv->fg[1], priv->fg[2], priv->fg[3] );
+			RPIFillBoxes( state, clip, &box, 1, mask, orgX, orgY );
+			RPIClipEnd( state );
+		}
+	}
+	return miHandleExposures(pSrc, pDest, pGC, srcx, srcy, w, h, destx, desty, plane);
 }
 
-static Bool RPIModeInit(ScrnInfoPtr pScrn, DisplayModePtr pMode)
+// Resolves CoordModePrevious into absolute coordinates. X coordinates are
+// shorts, so 16 bit wrap around matches what the protocol would give us.
+static void RPIPrefixSumPoints( const DDXPointRec* in, DDXPointRec* out, int npt )
 {
-	ErrorF("RPIModeInit\n");
-	return TRUE;
+	int i = 0;
+	short x = 0, y = 0;
+#ifdef __ARM_NEON__
+	// Four points per vector as interleaved x,y lanes: two shifted adds
+	// give the in-vector scan, then the previous vector's last point is
+	// added to every lane.
+	const int16x8_t zero = vdupq_n_s16(0);
+	int16x8_t carry = zero;
+	for( ; i + 4 <= npt; i += 4 )
+	{
+		int16x8_t v = vld1q_s16( (const int16_t*)&in[i] );
+		v = vaddq_s16( v, vextq_s16( zero, v, 6 ) );
+		v = vaddq_s16( v, vextq_s16( zero, v, 4 ) );
+		v = vaddq_s16( v, carry );
+		vst1q_s16( (int16_t*)&out[i], v );
+		carry = vreinterpretq_s16_s32( vdupq_n_s32( vgetq_lane_s32( vreinterpretq_s32_s16(v), 3 ) ) );
+	}
+	if( i > 0 )
+	{
+		x = out[i-1].x;
+		y = out[i-1].y;
+	}
+#endif
+	for( ; i < npt; ++i )
+	{
+		x += in[i].x;
+		y += in[i].y;
+		out[i].x = x;
+		out[i].y = y;
+	}
 }
 
-void RPIPutImage( DrawablePtr pDraw, GCPtr pGC, int depth, int x, int y, int w, int h, int leftpad, int format, char* pBits )
+// Moves the points into screen space and drops the ones outside the
+// composite clip in a single pass. Returns the number of points kept.
+static int RPICullPoints( const DDXPointRec* in, DDXPointRec* out, int npt, int dx, int dy, RegionPtr clip )
 {
-	ErrorF("RPIPutImage\n");
-}
+	BoxPtr ext = RegionExtents(clip);
+	Bool complex = RegionNumRects(clip) > 1;
+	BoxRec box;
+	int n = 0;
 
-void RPICopyArea( DrawablePtr pSrc, DrawablePtr pDest, GCPtr pGC, int srcx, int srcy, int w, int h, int destx, int desty )
-{
-	ErrorF("RPICopyArea\n");
-}
+	if( RegionNil(clip) )
+		return 0;
 
-void RPICopyPlane( DrawablePtr pSrc, DrawablePtr pDest, GCPtr pGC, int srcx, int srcy, int w, int h, int destx, int desty, unsigned long plane )
-{
-	ErrorF("RPICopyPlane\n");
+	for( int i = 0; i < npt; ++i )
+	{
+		int x = in[i].x + dx;
+		int y = in[i].y + dy;
+		if( x < ext->x1 || x >= ext->x2 || y < ext->y1 || y >= ext->y2 )
+			continue;
+		if( complex && !RegionContainsPoint(clip, x, y, &box) )
+			continue;
+		out[n].x = x;
+		out[n].y = y;
+		++n;
+	}
+	return n;
 }
 
 void RPIPolyPoint( DrawablePtr pDraw, GCPtr pGC, int mode, int npt, DDXPointPtr pptInit )
 {
-	ErrorF("RPIPolyPoint\n");
+	RPIPtr state = RPIDrawableState(pDraw);
+
+	if( !RPIPrepareDraw(state, pDraw) )
+	{
+		fbPolyPoint(pDraw, pGC, mode, npt, pptInit);
+		RPIPixmapDamage(pDraw);
+		return;
+	}
+	if( npt <= 0 )
+		return;
+
+	DDXPointPtr pts = RPIScratch( state, sizeof(DDXPointRec) * npt );
+	if( pts == NULL )
+		return;
+
+	// Culling only ever writes at or behind the point it reads, so it can
+	// compact the resolved points in place
+	const DDXPointRec* src = pptInit;
+	if( mode == CoordModePrevious )
+	{
+		RPIPrefixSumPoints( pptInit, pts, npt );
+		src = pts;
+	}
+	npt = RPICullPoints( src, pts, npt, pDraw->x, pDraw->y, pGC->pCompositeClip );
+	if( npt == 0 )
+		return;
+
+	RPIGCPrivPtr priv = RPIGetGCPriv(pGC);
+	RPIApplyFill( state, priv->logicOp, NULL );
+	glColor4f( priv->fg[0], priv->fg[1], priv->fg[2], priv->fg[3] );
+	glPointSize( 1.0f );
+	// Hit pixel centres
+	glTranslatef( 0.5f, 0.5f, 0.0f );
+
+	glEnableClientState( GL_VERTEX_ARRAY );
+	glVertexPointer( 2, GL_SHORT, 0, pts );
+	glDrawArrays( GL_POINTS, 0, npt );
 }
 
 void RPIPolyLines( DrawablePtr pDraw, GCPtr pGC, int mode, int npt, DDXPointPtr pptInit )
@@ -359,7 +2477,44 @@ void RPIFillPolygon( DrawablePtr pDraw, GCPtr pGC, int shape, int mode, int coun
 
 void RPIPolyFillRect( DrawablePtr pDraw, GCPtr pGC, int nRects, xRectangle* rects)
 {
-	ErrorF("RPIPolyFillRect\n");
+	RPIPtr state = RPIDrawableState(pDraw);
+	BoxRec stackBoxes[64];
+	BoxPtr boxes = stackBoxes;
+
+	if( !RPIPrepareDraw(state, pDraw) )
+	{
+		fbPolyFillRect(pDraw, pGC, nRects, rects);
+		RPIPixmapDamage(pDraw);
+		return;
+	}
+	if( nRects <= 0 )
+		return;
+	if( nRects > 64 && (boxes = malloc(sizeof(BoxRec) * nRects)) == NULL )
+		return;
+
+	int n = 0;
+	for( int i = 0; i < nRects; ++i )
+	{
+		int x1 = rects[i].x + pDraw->x;
+		int y1 = rects[i].y + pDraw->y;
+		int x2 = x1 + (int)rects[i].width;
+		int y2 = y1 + (int)rects[i].height;
+		boxes[n].x1 = max( x1, MINSHORT );
+		boxes[n].y1 = max( y1, MINSHORT );
+		boxes[n].x2 = min( x2, MAXSHORT );
+		boxes[n].y2 = min( y2, MAXSHORT );
+		if( boxes[n].x1 < boxes[n].x2 && boxes[n].y1 < boxes[n].y2 )
+			++n;
+	}
+	RegionPtr clip;
+	if( n > 0 && RPIClipBegin(state, pGC, &clip) )
+	{
+		RPIFillGC( state, pDraw, pGC, clip, boxes, n );
+		RPIClipEnd( state );
+	}
+
+	if( boxes != stackBoxes )
+		free(boxes);
 }
 
 void setPoint( GLfloat* arr, int i, float x, float y, float z )
@@ -371,8 +2526,10 @@ void setPoint( GLfloat* arr, int i, float x, float y, float z )
 
 void RPIPolyFillArc( DrawablePtr pDraw, GCPtr pGC, int nArcs, xArc* arcs )
 {
-	ScrnInfoPtr pScrn = xf86Screens[0];
-	RPIPtr state = RPIPTR(pScrn);
+	RPIPtr state = RPIDrawableState(pDraw);
+
+	if( !RPIMakeCurrent(state) )
+		return;
 	
   ErrorF("RPIPolyFillArc nArcs: %i\n", nArcs); 
   const int nPoints = 16 * 4;
@@ -386,6 +2543,7 @@ void RPIPolyFillArc( DrawablePtr pDraw, GCPtr pGC, int nArcs, xArc* arcs )
   setPoint(quadx, 1, cos( 0 )/2.0f + 0.5f, sin( 0 )/2.0f + 0.5f, 10 );
   setPoint(quadx, nPoints+1, cos( 0 )/2.0f + 0.5f, sin( 0 )/2.0f + 0.5f, 10 );
 
+  RPIApplyFill( state, GL_COPY, NULL );
   glClearColor(1.0f,0.0f,0.0f,1.0f);
   glClear( GL_COLOR_BUFFER_BIT );
   glEnableClientState( GL_VERTEX_ARRAY );
@@ -403,8 +2561,9 @@ void RPIPolyFillArc( DrawablePtr pDraw, GCPtr pGC, int nArcs, xArc* arcs )
   glDrawArrays( GL_TRIANGLE_FAN, 0, nPoints+2 );
 
   free(quadx);
+  state->projectionValid = FALSE;
 
-  eglSwapBuffers(state->display, state->surface);
+  eglSwapBuffers(state->shared->display, state->surface);
 }
 
 void RPIPolyText8( DrawablePtr pDraw, GCPtr pGC, int x, int y, int count, char* chars )
@@ -439,7 +2598,65 @@ void RPIPolyGlyphBlt( DrawablePtr pDraw, GCPtr pGC, int x, int y, unsigned int n
 
 void RPIPushPixels( GCPtr pGC, PixmapPtr pPix, DrawablePtr pDraw, int w, int h, int x, int y )
 {
-	ErrorF("RPIPushPixels\n");
+	RPIPtr state = RPIDrawableState(pDraw);
+	RPIGCPrivPtr priv = RPIGetGCPriv(pGC);
+
+	if( !RPIPrepareDraw(state, pDraw) )
+	{
+		fbPushPixels(pGC, pPix, pDraw, w, h, x, y);
+		RPIPixmapDamage(pDraw);
+		return;
+	}
+
+	RPITexturePtr mask = RPITexCacheLookup( state, pPix, 0, FALSE, NULL );
+	if( mask == NULL )
+		return;
+
+	BoxRec box;
+	box.x1 = pDraw->x + x;
+	box.y1 = pDraw->y + y;
+	box.x2 = box.x1 + min( w, (int)pPix->drawable.width );
+	box.y2 = box.y1 + min( h, (int)pPix->drawable.height );
+	if( box.x1 >= box.x2 || box.y1 >= box.y2 )
+		return;
+
+	RegionPtr clip;
+	if( !RPIClipBegin(state, pGC, &clip) )
+		return;
+
+	if( priv->program == RPI_FILL_SOLID )
+	{
+		RPIApplyStipple( state, priv->logicOp, mask, FALSE );
+		glColor4f( priv->fill[0], priv->fill[1], priv->fill[2], priv->fill[3] );
+		RPIFillBoxes( state, clip, &box, 1, mask, box.x1, box.y1 );
+		RPIClipEnd( state );
+		return;
+	}
+
+	// Tiled and stippled fills go through a stencil mask: mark the set bits
+	// in the top stencil bit, fill the box through it, then clear it again.
+	// The low bits may hold the clip, which every pass keeps testing.
+	RPIStencilBegin( state );
+	glStencilMask( 0x80 );
+	glColorMask( GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE );
+	glStencilFunc( GL_EQUAL, 0x80 | state->clipRef, state->clipMask );
+	glStencilOp( GL_KEEP, GL_KEEP, GL_REPLACE );
+	RPIApplyStipple( state, GL_COPY, mask, FALSE );
+	RPIFillBoxes( state, clip, &box, 1, mask, box.x1, box.y1 );
+
+	glColorMask( GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE );
+	glStencilFunc( GL_EQUAL, 0x80 | state->clipRef, 0x80 | state->clipMask );
+	glStencilOp( GL_KEEP, GL_KEEP, GL_KEEP );
+	RPIFillGC( state, pDraw, pGC, clip, &box, 1 );
+
+	glColorMask( GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE );
+	glStencilFunc( GL_ALWAYS, 0, 0 );
+	glStencilOp( GL_KEEP, GL_KEEP, GL_ZERO );
+	RPIApplyFill( state, GL_COPY, NULL );
+	RPIFillBoxes( state, clip, &box, 1, NULL, 0, 0 );
+
+	glColorMask( GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE );
+	RPIClipEnd( state );
 }
 
 static GCOps RPIGCOps = {
@@ -465,17 +2682,523 @@ RPIPolyGlyphBlt,
 RPIPushPixels
 };
 
+// Whether fb can read the picture, which is anything but a window drawn to
+// the GL surface
+static Bool RPIPictureHasBits( PicturePtr pPict )
+{
+	return pPict == NULL || pPict->pDrawable == NULL || !RPIOnScreen(pPict->pDrawable) ||
+			RPIDrawableState(pPict->pDrawable)->released;
+}
+
+// Unmasked copies and blends of untransformed pixmaps the texture cache
+// can hold with their colours intact
+static Bool RPICompositeDirect( RPIPtr state, CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst,
+		INT16 xSrc, INT16 ySrc, INT16 xDst, INT16 yDst, RegionPtr region )
+{
+	DrawablePtr pDraw = pDst->pDrawable;
+
+	if( pMask != NULL || pSrc->pDrawable == NULL || pSrc->transform != NULL || pSrc->alphaMap != NULL ||
+			pDst->alphaMap != NULL || pSrc->repeat )
+		return FALSE;
+	if( op != PictOpSrc && op != PictOpOver )
+		return FALSE;
+	switch( pSrc->format )
+	{
+	case PICT_x8r8g8b8:
+	case PICT_r5g6b5:
+		break;
+	case PICT_a8r8g8b8:
+		// Uploads only keep alpha where GL takes BGRA
+		if( op == PictOpSrc || state->shared->hasBGRA )
+			break;
+		// fall through
+	default:
+		return FALSE;
+	}
+
+	int xoff, yoff;
+	PixmapPtr pPix = RPIDrawablePixmap( pSrc->pDrawable, &xoff, &yoff );
+	RPITexturePtr t = RPITexCacheLookup( state, pPix, 0, FALSE, NULL );
+	if( t == NULL )
+		return FALSE;
+	RPIApplyFill( state, GL_COPY, t );
+	// Premultiplied, as RENDER keeps it
+	if( op == PictOpOver && PICT_FORMAT_A(pSrc->format) != 0 )
+	{
+		glEnable( GL_BLEND );
+		glBlendFunc( GL_ONE, GL_ONE_MINUS_SRC_ALPHA );
+	}
+	RPIFillBoxes( state, NULL, RegionRects(region), RegionNumRects(region), t,
+			pDraw->x + xDst - xSrc - xoff, pDraw->y + yDst - ySrc - yoff );
+	glDisable( GL_BLEND );
+	return TRUE;
+}
+
+// The premultiplied a8r8g8b8 colour of a solid source: a solid fill or a
+// repeating 1x1 pixmap
+static Bool RPISolidColor( PicturePtr pPict, CARD32* color )
+{
+	if( pPict->pSourcePict != NULL )
+	{
+		if( pPict->pSourcePict->type != SourcePictTypeSolidFill )
+			return FALSE;
+		*color = pPict->pSourcePict->solidFill.color;
+		return TRUE;
+	}
+	if( pPict->pDrawable == NULL || !pPict->repeat || pPict->alphaMap != NULL ||
+			pPict->pDrawable->width != 1 || pPict->pDrawable->height != 1 )
+		return FALSE;
+
+	int xoff, yoff;
+	PixmapPtr pPix = RPIDrawablePixmap( pPict->pDrawable, &xoff, &yoff );
+	const CARD32* pixel = (const CARD32*)((const CARD8*)pPix->devPrivate.ptr + yoff * pPix->devKind) + xoff;
+	switch( pPict->format )
+	{
+	case PICT_a8r8g8b8:
+		*color = *pixel;
+		return TRUE;
+	case PICT_x8r8g8b8:
+		*color = *pixel | 0xff000000;
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+// A solid colour, optionally through an a8 mask. This is what the mask
+// miTrapezoids and miTriangles rasterize with pixman comes back as, and
+// what cairo fills and strokes mostly are.
+static Bool RPICompositeSolid( RPIPtr state, CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst,
+		INT16 xMask, INT16 yMask, INT16 xDst, INT16 yDst, RegionPtr region )
+{
+	DrawablePtr pDraw = pDst->pDrawable;
+	RPITexturePtr mask = NULL;
+	int xoff = 0, yoff = 0;
+	CARD32 color;
+	GLenum dstFactor;
+
+	if( pDst->alphaMap != NULL || !RPISolidColor(pSrc, &color) )
+		return FALSE;
+	if( pMask != NULL && (pMask->pDrawable == NULL || pMask->format != PICT_a8 || pMask->transform != NULL ||
+			pMask->alphaMap != NULL || pMask->componentAlpha || pMask->repeat) )
+		return FALSE;
+	switch( op )
+	{
+	case PictOpOver:
+		dstFactor = GL_ONE_MINUS_SRC_ALPHA;
+		break;
+	case PictOpAdd:
+		dstFactor = GL_ONE;
+		break;
+	case PictOpSrc:
+		// Src replaces the destination with src IN mask, which is what the
+		// mask modulated colour already is
+		dstFactor = GL_ZERO;
+		break;
+	default:
+		return FALSE;
+	}
+
+	if( pMask != NULL )
+	{
+		PixmapPtr pPix = RPIDrawablePixmap( pMask->pDrawable, &xoff, &yoff );
+		if( (mask = RPITexCacheLookup(state, pPix, 0, FALSE, NULL)) == NULL )
+			return FALSE;
+		RPIApplyProgram( state, GL_COPY, mask, RPI_FILL_MASK );
+	}
+	else
+		RPIApplyFill( state, GL_COPY, NULL );
+	glColor4f( ((color >> 16) & 0xff) / 255.0f, ((color >> 8) & 0xff) / 255.0f, (color & 0xff) / 255.0f, (color >> 24) / 255.0f );
+	glEnable( GL_BLEND );
+	glBlendFunc( GL_ONE, dstFactor );
+	RPIFillBoxes( state, NULL, RegionRects(region), RegionNumRects(region), mask,
+			pDraw->x + xDst - xMask - xoff, pDraw->y + yDst - yMask - yoff );
+	glDisable( GL_BLEND );
+	return TRUE;
+}
+
+// Finds or builds the ramp texture for a gradient's stops. pixman evaluates
+// the stops across it, as it would per pixel for fb.
+static RPITexturePtr RPIRampLookup( RPIPtr state, PictGradient* gradient, int repeat )
+{
+	uint64_t hash = RPIHashWords( (const CARD32*)gradient->stops, gradient->nstops * sizeof(PictGradientStop) / 4 );
+	RPIRamp* victim = &state->shared->ramps[0];
+
+	++state->shared->texClock;
+	for( int i = 0; i < RPI_RAMPS; ++i )
+	{
+		RPIRamp* r = &state->shared->ramps[i];
+		if( r->tex.tex != 0 && r->hash == hash && r->nstops == gradient->nstops && r->repeat == repeat )
+		{
+			r->lastUse = state->shared->texClock;
+			return &r->tex;
+		}
+		if( r->lastUse < victim->lastUse )
+			victim = r;
+	}
+
+	CARD32* texels = RPIScratch( state, RPI_RAMP_SIZE * 4 );
+	if( texels == NULL )
+		return NULL;
+	pixman_point_fixed_t p1 = { 0, 0 };
+	pixman_point_fixed_t p2 = { pixman_int_to_fixed(RPI_RAMP_SIZE), 0 };
+	pixman_image_t* ramp = pixman_image_create_linear_gradient( &p1, &p2,
+			(const pixman_gradient_stop_t*)gradient->stops, gradient->nstops );
+	pixman_image_t* dst = pixman_image_create_bits( PIXMAN_a8r8g8b8, RPI_RAMP_SIZE, 1, texels, RPI_RAMP_SIZE * 4 );
+	Bool ok = ramp != NULL && dst != NULL;
+	if( ok )
+		pixman_image_composite32( PIXMAN_OP_SRC, ramp, NULL, dst, 0, 0, 0, 0, 0, 0, RPI_RAMP_SIZE, 1 );
+	if( ramp != NULL )
+		pixman_image_unref( ramp );
+	if( dst != NULL )
+		pixman_image_unref( dst );
+	if( !ok )
+		return NULL;
+
+	GLenum format = GL_RGBA;
+	if( state->shared->hasBGRA )
+		format = GL_BGRA_EXT;
+	else
+	{
+		// RPISwizzleRow drops alpha, which a ramp needs
+		for( int i = 0; i < RPI_RAMP_SIZE; ++i )
+			texels[i] = (texels[i] & 0xff00ff00) | ((texels[i] >> 16) & 0xff) | ((texels[i] & 0xff) << 16);
+	}
+
+	RPITexturePtr t = &victim->tex;
+	if( t->tex == 0 )
+		glGenTextures( 1, &t->tex );
+	glBindTexture( GL_TEXTURE_2D, t->tex );
+	state->shared->boundTex = t->tex;
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+	glTexImage2D( GL_TEXTURE_2D, 0, format, RPI_RAMP_SIZE, 1, 0, format, GL_UNSIGNED_BYTE, texels );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, repeat == RepeatNormal ? GL_REPEAT : GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	t->width = t->texWidth = RPI_RAMP_SIZE;
+	t->height = t->texHeight = 1;
+	t->format = format;
+	t->type = GL_UNSIGNED_BYTE;
+	t->alpha = FALSE;
+	victim->hash = hash;
+	victim->nstops = gradient->nstops;
+	victim->repeat = repeat;
+	victim->lastUse = state->shared->texClock;
+	return t;
+}
+
+// An unmasked linear gradient. The gradient parameter is linear in screen
+// coordinates, so it is worked out at the corners of each box and GL
+// interpolates it into the ramp. Radial and conical gradients would need
+// per pixel maths GLES 1.1 cannot do, so they are read back instead.
+static Bool RPICompositeLinear( RPIPtr state, CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst,
+		INT16 xSrc, INT16 ySrc, INT16 xDst, INT16 yDst, RegionPtr region )
+{
+	DrawablePtr pDraw = pDst->pDrawable;
+	SourcePictPtr pSource = pSrc->pSourcePict;
+
+	if( pMask != NULL || pSource == NULL || pSource->type != SourcePictTypeLinear || pSrc->transform != NULL ||
+			pSrc->alphaMap != NULL || pDst->alphaMap != NULL || pSource->linear.nstops < 1 )
+		return FALSE;
+	if( (op != PictOpSrc && op != PictOpOver) || (pSrc->repeatType != RepeatNormal && pSrc->repeatType != RepeatPad) )
+		return FALSE;
+
+	GLfloat gx = xFixedToDouble(pSource->linear.p1.x);
+	GLfloat gy = xFixedToDouble(pSource->linear.p1.y);
+	GLfloat dx = xFixedToDouble(pSource->linear.p2.x) - gx;
+	GLfloat dy = xFixedToDouble(pSource->linear.p2.y) - gy;
+	GLfloat len2 = dx * dx + dy * dy;
+	if( len2 == 0.0f )
+		return FALSE;
+	dx /= len2;
+	dy /= len2;
+	// Screen position of the source origin
+	gx += pDraw->x + xDst - xSrc;
+	gy += pDraw->y + yDst - ySrc;
+
+	RPITexturePtr ramp = RPIRampLookup( state, &pSource->gradient, pSrc->repeatType );
+	if( ramp == NULL )
+		return FALSE;
+
+	RPIBatch batch;
+	batch.v = RPIScratch( state, sizeof(RPIVertex) * RPI_BATCH_QUADS * 6 );
+	batch.n = 0;
+	batch.textured = TRUE;
+	if( batch.v == NULL )
+		return FALSE;
+
+	RPIApplyFill( state, GL_COPY, ramp );
+	if( op == PictOpOver )
+	{
+		glEnable( GL_BLEND );
+		glBlendFunc( GL_ONE, GL_ONE_MINUS_SRC_ALPHA );
+	}
+	const BoxRec* boxes = RegionRects(region);
+	for( int i = 0; i < RegionNumRects(region); ++i )
+	{
+		// Corners in RPIBatchQuad order
+		const GLfloat x[6] = { boxes[i].x1, boxes[i].x2, boxes[i].x1, boxes[i].x2, boxes[i].x2, boxes[i].x1 };
+		const GLfloat y[6] = { boxes[i].y1, boxes[i].y1, boxes[i].y2, boxes[i].y1, boxes[i].y2, boxes[i].y2 };
+		if( batch.n + 6 > RPI_BATCH_QUADS * 6 )
+			RPIBatchFlush( &batch );
+		for( int k = 0; k < 6; ++k )
+			batch.v[batch.n + k] = (RPIVertex){ x[k], y[k], (x[k] - gx) * dx + (y[k] - gy) * dy, 0.5f };
+		batch.n += 6;
+	}
+	RPIBatchFlush( &batch );
+	glDisable( GL_BLEND );
+	return TRUE;
+}
+
+// Everything else: fb composites into a copy of the destination area read
+// back from the screen, which then goes back up
+static void RPICompositeReadBack( RPIPtr state, CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst, INT16 xSrc, INT16 ySrc,
+		INT16 xMask, INT16 yMask, INT16 xDst, INT16 yDst, CARD16 width, CARD16 height, RegionPtr region )
+{
+	DrawablePtr pDraw = pDst->pDrawable;
+	ScreenPtr pScreen = pDraw->pScreen;
+	BoxPtr ext = RegionExtents(region);
+	int w = ext->x2 - ext->x1;
+	int h = ext->y2 - ext->y1;
+	int error;
+
+	PixmapPtr pPix = pScreen->CreatePixmap( pScreen, w, h, pDraw->depth, 0 );
+	if( pPix == NullPixmap )
+		return;
+	PicturePtr pTmp = CreatePicture( 0, &pPix->drawable, pDst->pFormat, 0, NULL, serverClient, &error );
+	if( pTmp != NULL && RPIReadPixels(state, ext->x1, ext->y1, w, h, pPix->devPrivate.ptr, pPix->devKind) )
+	{
+		fbComposite( op, pSrc, pMask, pTmp, xSrc, ySrc, xMask, yMask,
+				xDst + pDraw->x - ext->x1, yDst + pDraw->y - ext->y1, width, height );
+		RPITexturePtr t = RPITexCacheLookup( state, pPix, 0, FALSE, NULL );
+		if( t != NULL )
+		{
+			RPIApplyFill( state, GL_COPY, t );
+			RPIFillBoxes( state, NULL, RegionRects(region), RegionNumRects(region), t, ext->x1, ext->y1 );
+		}
+	}
+	if( pTmp != NULL )
+		FreePicture( pTmp, 0 );
+	pScreen->DestroyPixmap( pPix );
+}
+
+// A temporary picture with what an on screen window picture shows, read
+// back from the GL surface. Only the part of the window x,y,w,h covers is
+// read unless a transform or repeat can reach the rest; x and y are moved
+// to match the copy.
+static PicturePtr RPIPictureReadBack( PicturePtr pPict, INT16* x, INT16* y, CARD16 w, CARD16 h )
+{
+	DrawablePtr pDraw = pPict->pDrawable;
+	ScreenPtr pScreen = pDraw->pScreen;
+	PictureScreenPtr ps = GetPictureScreen(pScreen);
+	RPIPtr state = RPIDrawableState(pDraw);
+	BoxRec box = { 0, 0, pDraw->width, pDraw->height };
+	XID values[2] = { pPict->repeat ? pPict->repeatType : RepeatNone, pPict->componentAlpha };
+	int error;
+
+	if( pPict->alphaMap != NULL )
+		return NULL;
+	if( pPict->transform == NULL && !pPict->repeat )
+	{
+		box.x1 = max( (int)*x, 0 );
+		box.y1 = max( (int)*y, 0 );
+		box.x2 = max( (int)box.x1 + 1, min(*x + w, (int)pDraw->width) );
+		box.y2 = max( (int)box.y1 + 1, min(*y + h, (int)pDraw->height) );
+	}
+
+	PixmapPtr pPix = pScreen->CreatePixmap( pScreen, box.x2 - box.x1, box.y2 - box.y1, pDraw->depth, 0 );
+	if( pPix == NullPixmap )
+		return NULL;
+	// Off the screen the window shows nothing
+	memset( pPix->devPrivate.ptr, 0, (size_t)pPix->devKind * pPix->drawable.height );
+	BoxRec rd;
+	rd.x1 = max( (int)box.x1, -pDraw->x );
+	rd.y1 = max( (int)box.y1, -pDraw->y );
+	rd.x2 = min( (int)box.x2, state->width - pDraw->x );
+	rd.y2 = min( (int)box.y2, state->height - pDraw->y );
+	if( rd.x1 < rd.x2 && rd.y1 < rd.y2 )
+	{
+		CARD8* bits = (CARD8*)pPix->devPrivate.ptr + (rd.y1 - box.y1) * pPix->devKind + (rd.x1 - box.x1) * (pDraw->bitsPerPixel / 8);
+		if( !RPIReadPixels(state, pDraw->x + rd.x1, pDraw->y + rd.y1, rd.x2 - rd.x1, rd.y2 - rd.y1, bits, pPix->devKind) )
+		{
+			pScreen->DestroyPixmap( pPix );
+			return NULL;
+		}
+	}
+
+	// The picture keeps its own reference to the pixmap
+	PicturePtr pTmp = CreatePicture( 0, &pPix->drawable, pPict->pFormat, CPRepeat | CPComponentAlpha, values, serverClient, &error );
+	pScreen->DestroyPixmap( pPix );
+	if( pTmp == NULL )
+		return NULL;
+	if( pPict->transform != NULL )
+		SetPictureTransform( pTmp, pPict->transform );
+	for( int i = 0; i < ps->nfilters; ++i )
+	{
+		if( ps->filters[i].id == pPict->filter )
+			SetPicturePictFilter( pTmp, &ps->filters[i], pPict->filter_params, pPict->filter_nparams );
+	}
+	if( pPict->clientClipType == CT_REGION )
+		SetPictureClipRegion( pTmp, pPict->clipOrigin.x - box.x1, pPict->clipOrigin.y - box.y1, (RegionPtr)pPict->clientClip );
+	*x -= box.x1;
+	*y -= box.y1;
+	return pTmp;
+}
+
+// RENDER Composite. This is how a compositing manager paints redirected
+// windows, whose pixmaps stay in the texture cache between frames, so a
+// move or restack only draws them again from there.
+static void RPIComposite( CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst, INT16 xSrc, INT16 ySrc,
+		INT16 xMask, INT16 yMask, INT16 xDst, INT16 yDst, CARD16 width, CARD16 height )
+{
+	DrawablePtr pDraw = pDst->pDrawable;
+	RPIPtr state = RPIDrawableState(pDraw);
+	PicturePtr pSrcTmp = NULL, pMaskTmp = NULL;
+	RegionRec region;
+
+	// Windows on the GL surface have no bits for fb or the texture cache
+	if( !RPIPictureHasBits(pSrc) && (pSrc = pSrcTmp = RPIPictureReadBack(pSrc, &xSrc, &ySrc, width, height)) == NULL )
+		return;
+	if( !RPIPictureHasBits(pMask) && (pMask = pMaskTmp = RPIPictureReadBack(pMask, &xMask, &yMask, width, height)) == NULL )
+	{
+		if( pSrcTmp != NULL )
+			FreePicture( pSrcTmp, 0 );
+		return;
+	}
+
+	if( !RPIPrepareDraw(state, pDraw) )
+	{
+		fbComposite( op, pSrc, pMask, pDst, xSrc, ySrc, xMask, yMask, xDst, yDst, width, height );
+		RPIPixmapDamage( pDraw );
+	}
+	else if( miComputeCompositeRegion(&region, pSrc, pMask, pDst, xSrc, ySrc, xMask, yMask, xDst, yDst, width, height) )
+	{
+		if( !RPICompositeDirect(state, op, pSrc, pMask, pDst, xSrc, ySrc, xDst, yDst, &region) &&
+				!RPICompositeSolid(state, op, pSrc, pMask, pDst, xMask, yMask, xDst, yDst, &region) &&
+				!RPICompositeLinear(state, op, pSrc, pMask, pDst, xSrc, ySrc, xDst, yDst, &region) )
+			RPICompositeReadBack( state, op, pSrc, pMask, pDst, xSrc, ySrc, xMask, yMask, xDst, yDst, width, height, &region );
+		RegionUninit( &region );
+	}
+	if( pSrcTmp != NULL )
+		FreePicture( pSrcTmp, 0 );
+	if( pMaskTmp != NULL )
+		FreePicture( pMaskTmp, 0 );
+}
+
+// Puts a read back copy of an on screen window picture, changed by fb, back
+// on the surface inside the picture's clip
+static void RPIPictureWriteBack( PicturePtr pPict, PicturePtr pTmp )
+{
+	DrawablePtr pDraw = pPict->pDrawable;
+	RPIPtr state = RPIDrawableState(pDraw);
+	RPITexturePtr t;
+
+	if( RPIPrepareDraw(state, pDraw) && (t = RPITexCacheLookup(state, (PixmapPtr)pTmp->pDrawable, 0, FALSE, NULL)) != NULL )
+	{
+		BoxRec box = { pDraw->x, pDraw->y, pDraw->x + pDraw->width, pDraw->y + pDraw->height };
+		RPIApplyFill( state, GL_COPY, t );
+		RPIFillBoxes( state, pPict->pCompositeClip, &box, 1, t, pDraw->x, pDraw->y );
+	}
+	FreePicture( pTmp, 0 );
+}
+
+// RENDER AddTraps and AddTriangles rasterize straight into the picture's
+// bits: fb does that for pixmaps, whose GL copies are then stale, and for
+// on screen windows into a read back copy
+static void RPIAddTraps( PicturePtr pPict, INT16 xOff, INT16 yOff, int ntrap, xTrap* traps )
+{
+	INT16 x = 0, y = 0;
+	PicturePtr pTmp;
+
+	if( RPIPictureHasBits(pPict) )
+	{
+		fbAddTraps( pPict, xOff, yOff, ntrap, traps );
+		RPIPixmapDamage( pPict->pDrawable );
+	}
+	else if( (pTmp = RPIPictureReadBack(pPict, &x, &y, pPict->pDrawable->width, pPict->pDrawable->height)) != NULL )
+	{
+		fbAddTraps( pTmp, xOff, yOff, ntrap, traps );
+		RPIPictureWriteBack( pPict, pTmp );
+	}
+}
+
+static void RPIAddTriangles( PicturePtr pPict, INT16 xOff, INT16 yOff, int ntri, xTriangle* tris )
+{
+	INT16 x = 0, y = 0;
+	PicturePtr pTmp;
+
+	if( RPIPictureHasBits(pPict) )
+	{
+		fbAddTriangles( pPict, xOff, yOff, ntri, tris );
+		RPIPixmapDamage( pPict->pDrawable );
+	}
+	else if( (pTmp = RPIPictureReadBack(pPict, &x, &y, pPict->pDrawable->width, pPict->pDrawable->height)) != NULL )
+	{
+		fbAddTriangles( pTmp, xOff, yOff, ntri, tris );
+		RPIPictureWriteBack( pPict, pTmp );
+	}
+}
+
 void RPIChangeGC(GCPtr pGC, unsigned long mask)
 {
-	ErrorF("RPIChangeGC\n");
 }
 
 void RPIValidateGC(GCPtr pGC, unsigned long changes, DrawablePtr pDraw )
 {
-//	ErrorF("RPIValidateGC\n");
-//	ScrnInfoPtr pScrn = xf86Screens[0];
-//	RPIPtr state = RPIPTR(pScrn);
-//  eglSwapBuffers(state->display, state->surface);
+	// fb keeps the composite clip up to date and is needed for the
+	// fallbacks on pixmaps anyway
+	RPIGCPrivPtr priv = RPIGetGCPriv(pGC);
+	ScrnInfoPtr pScrn = xf86Screens[pGC->pScreen->myNum];
+
+	// Same test fb uses to decide the composite clip needs recomputing
+	if( (changes & (GCClipXOrigin|GCClipYOrigin|GCClipMask|GCSubwindowMode)) ||
+			pDraw->serialNumber != (pGC->serialNumber & DRAWABLE_SERIAL_BITS) )
+		priv->clipSerial = ++RPIClipSerial;
+
+	fbValidateGC(pGC, changes, pDraw);
+	if( !(changes & (GCFunction|GCForeground|GCBackground|GCFillStyle|GCTile|GCStipple)) )
+		return;
+
+	priv->logicOp = GL_CLEAR + pGC->alu;
+	RPIPixelToColor( pScrn, pGC->fgPixel, priv->fg );
+	RPIPixelToColor( pScrn, pGC->bgPixel, priv->bg );
+	memcpy( priv->fill, priv->fg, sizeof(priv->fill) );
+
+	PixmapPtr fillPixmap = NULL;
+	switch( pGC->fillStyle )
+	{
+	case FillTiled:
+		if( pGC->tileIsPixel )
+		{
+			priv->program = RPI_FILL_SOLID;
+			RPIPixelToColor( pScrn, pGC->tile.pixel, priv->fill );
+		}
+		else
+		{
+			priv->program = RPI_FILL_TILE;
+			fillPixmap = pGC->tile.pixmap;
+		}
+		break;
+	case FillStippled:
+		priv->program = RPI_FILL_STIPPLE;
+		fillPixmap = pGC->stipple;
+		break;
+	case FillOpaqueStippled:
+		priv->program = RPI_FILL_OPAQUE_STIPPLE;
+		fillPixmap = pGC->stipple;
+		break;
+	default:
+		priv->program = RPI_FILL_SOLID;
+		break;
+	}
+	if( priv->program != RPI_FILL_SOLID && fillPixmap == NULL )
+		priv->program = RPI_FILL_SOLID;
+	if( fillPixmap != priv->fillPixmap )
+	{
+		priv->fillPixmap = fillPixmap;
+		priv->fillTex = NULL;
+	}
 }
 /*
 void RPICopyGC()
@@ -484,7 +3207,7 @@ void RPICopyGC()
 */
 void RPIDestroyGC( GCPtr pGC )
 {
-	ErrorF("RPIDestroyGC\n");
+	miDestroyGC(pGC);
 }
 /*
 void RPIChangeClip()
@@ -493,7 +3216,7 @@ void RPIChangeClip()
 */
 void RPIDestroyClip( GCPtr pGC )
 {
-	ErrorF("RPIDestroyClip\n");
+	miDestroyClip(pGC);
 }
 /*
 void RPICopyClip()
@@ -513,6 +3236,26 @@ miCopyClip//	RPICopyClip
 Bool RPICloseScreen( int index, ScreenPtr pScreen )
 {
 	ErrorF("RPICloseScreen\n");
+	ScrnInfoPtr pScrn = xf86Screens[index];
+	RPIPtr state = RPIPTR(pScrn);
+	// The texture cache belongs to every screen, drop it with the last one
+	if( --state->shared->screens == 0 )
+	{
+		unsigned int lookups = state->shared->texHits + state->shared->texMisses;
+		INFO_MSG("Texture cache: %u hits, %u misses (%u%% hit rate)", state->shared->texHits, state->shared->texMisses,
+				lookups ? state->shared->texHits * 100 / lookups : 0);
+		RPITexCacheFini(state);
+	}
+	RPICaptureFini(state);
+	RPIBackgroundsFini(state);
+	if( state->restoring )
+	{
+		RegionUninit(&state->restoreFirst);
+		RegionUninit(&state->restoreRest);
+		state->restoring = FALSE;
+	}
+	free(state->shadow);
+	state->shadow = NULL;
 
   DepthPtr depths = pScreen->allowedDepths;
   for( int i = 0; i < pScreen->numDepths; ++i )
@@ -537,12 +3280,51 @@ Bool RPISaveScreen( ScreenPtr pScreen, int on )
 
 void RPIGetImage( DrawablePtr pDraw, int sx, int sy, int w, int h, unsigned int format, unsigned long planemask, char* pdstLine )
 {
-	ErrorF("RPIGetImage\n");
+	// Pixmaps and redirected windows hold their bits for fb, and so do
+	// windows while the surface is released for a VT switch
+	if( !RPIOnScreen(pDraw) || RPIDrawableState(pDraw)->released )
+	{
+		fbGetImage(pDraw, sx, sy, w, h, format, planemask, pdstLine);
+		return;
+	}
+	if( w <= 0 || h <= 0 )
+		return;
+
+	RPIPtr state = RPIDrawableState(pDraw);
+	if( format != ZPixmap )
+	{
+		// XYPixmap: fb splits a read back copy of the area into planes
+		ScreenPtr pScreen = pDraw->pScreen;
+		PixmapPtr pPix = pScreen->CreatePixmap( pScreen, w, h, pDraw->depth, 0 );
+		if( pPix == NullPixmap )
+			return;
+		if( RPIReadPixels(state, pDraw->x + sx, pDraw->y + sy, w, h, pPix->devPrivate.ptr, pPix->devKind) )
+			fbGetImage( &pPix->drawable, 0, 0, w, h, format, planemask, pdstLine );
+		pScreen->DestroyPixmap( pPix );
+		return;
+	}
+	int stride = PixmapBytePad(w, pDraw->depth);
+	if( !RPIReadPixels(state, pDraw->x + sx, pDraw->y + sy, w, h, (CARD8*)pdstLine, stride) )
+		return;
+
+	FbBits pm = fbReplicatePixel(planemask, pDraw->bitsPerPixel);
+	if( (pm & FbFullMask(pDraw->depth)) != FbFullMask(pDraw->depth) )
+	{
+		for( int y = 0; y < h; ++y )
+		{
+			FbBits* line = (FbBits*)(pdstLine + y * stride);
+			for( int i = 0; i < stride / (int)sizeof(FbBits); ++i )
+				line[i] &= pm;
+		}
+	}
 }
 
 Bool RPICreateWindow( WindowPtr pWin )
 {
 	ErrorF("RPICreateWindow\n");
+	// As fbCreateWindow: windows draw through the screen pixmap, which only
+	// has bits while the surface is released for a VT switch
+	_fbSetWindowPixmap(pWin, pWin->drawable.pScreen->devPrivate);
 	return TRUE;
 }
 
@@ -581,25 +3363,179 @@ int RPIValidateTree( WindowPtr pParent, WindowPtr pChild, VTKind vtk )
   return miValidateTree(pParent, pChild, vtk);
 }
 
-void RPIWindowExposures( WindowPtr pWin, RegionPtr region, RegionPtr others )
+// Queues region (screen coordinates) of pWin's background for the next
+// flush. Backgrounds fb draws are painted by mi straight away.
+static void RPIPaintBackground( WindowPtr pWin, RegionPtr region )
+{
+	ScrnInfoPtr pScrn = xf86Screens[pWin->drawable.pScreen->myNum];
+	RPIPtr state = RPIPTR(pScrn);
+
+	if( !RPIOnScreen(&pWin->drawable) || state->released )
+	{
+		miPaintWindow( pWin, region, PW_BACKGROUND );
+		return;
+	}
+
+	// ParentRelative takes the background and tile origin of the ancestor
+	WindowPtr pBg = pWin;
+	while( pBg->backgroundState == ParentRelative )
+		pBg = pBg->parent;
+	if( pBg->backgroundState == None || !RegionNotEmpty(region) )
+		return;
+	PixmapPtr tile = pBg->backgroundState == BackgroundPixmap ? pBg->background.pixmap : NULL;
+	Pixel pixel = tile ? 0 : pBg->background.pixel;
+
+	// A later paint wins where it overlaps an earlier one, which keeps the
+	// queued regions apart so they can be flushed in any order
+	RPIBackground* match = NULL;
+	for( int i = 0; i < state->nBackgrounds; ++i )
+	{
+		RPIBackground* bg = &state->backgrounds[i];
+		if( bg->tile == tile && (tile ? bg->orgX == pBg->drawable.x && bg->orgY == pBg->drawable.y : bg->pixel == pixel) )
+			match = bg;
+		else
+			RegionSubtract( &bg->region, &bg->region, region );
+	}
+	if( match == NULL )
+	{
+		if( state->nBackgrounds == RPI_BACKGROUNDS && !RPIPrepareDraw(state, &pWin->drawable) )
+			return;
+		match = &state->backgrounds[state->nBackgrounds++];
+		match->tile = tile;
+		match->pixel = pixel;
+		match->orgX = pBg->drawable.x;
+		match->orgY = pBg->drawable.y;
+		RPIPixelToColor( pScrn, pixel, match->color );
+		RegionNull( &match->region );
+		if( tile != NULL )
+			tile->refcnt++;
+	}
+	RegionUnion( &match->region, &match->region, region );
+	// Damage only sees drawing that goes through the GC
+	DamageDamageRegion( &pWin->drawable, region );
+}
+
+// Exposures with more rectangles than this are sent as their extents
+#define RPI_EXPOSE_RECTS 25
+
+// As miWindowExposures, but the background is queued rather than painted
+// so that the exposures of one dispatch cycle are filled together
+void RPIWindowExposures( WindowPtr pWin, RegionPtr prgn, RegionPtr other_exposed )
 {
-	ErrorF("RPIWindowExposures\n");
-  miWindowExposures(pWin,region,others);
+	Bool clientInterested = ((pWin->eventMask | wOtherEventMasks(pWin)) & ExposureMask) != 0;
+	RegionPtr exposures = prgn;
+	RegionRec extents;
+
+	RegionNull( &extents );
+	if( other_exposed != NULL )
+	{
+		if( prgn != NULL )
+			RegionUnion( other_exposed, prgn, other_exposed );
+		exposures = other_exposed;
+	}
+	// The client repaints all of the extents, so they get background too
+	if( clientInterested && exposures != NULL && RegionNumRects(exposures) > RPI_EXPOSE_RECTS )
+	{
+		RegionReset( &extents, RegionExtents(exposures) );
+		if( prgn != NULL )
+		{
+			RegionUnion( prgn, prgn, &extents );
+			RegionIntersect( prgn, prgn, &pWin->clipList );
+		}
+		exposures = &extents;
+	}
+	if( prgn != NULL && RegionNotEmpty(prgn) )
+		RPIPaintBackground( pWin, prgn );
+	if( clientInterested && exposures != NULL && RegionNotEmpty(exposures) )
+		miSendExposures( pWin, exposures, pWin->drawable.x, pWin->drawable.y );
+	RegionUninit( &extents );
+	if( prgn != NULL )
+		RegionEmpty( prgn );
 }
 
+// As miClearToBackground, with the background queued
 void RPIClearToBackground( WindowPtr pWin, int x, int y, int w, int h, Bool genExposure )
 {
+	BoxPtr extents = RegionExtents(&pWin->clipList);
+	int x1 = pWin->drawable.x + x;
+	int y1 = pWin->drawable.y + y;
+	int x2 = w ? x1 + w : x1 + pWin->drawable.width - x;
+	int y2 = h ? y1 + h : y1 + pWin->drawable.height - y;
+
+	BoxRec box;
+	box.x1 = max( x1, (int)extents->x1 );
+	box.y1 = max( y1, (int)extents->y1 );
+	box.x2 = min( x2, (int)extents->x2 );
+	box.y2 = min( y2, (int)extents->y2 );
+	if( box.x1 >= box.x2 || box.y1 >= box.y2 )
+		return;
+
+	RegionRec reg;
+	RegionInit( &reg, &box, 1 );
+	RegionIntersect( &reg, &reg, &pWin->clipList );
+	if( genExposure )
+		pWin->drawable.pScreen->WindowExposures( pWin, &reg, NULL );
+	else if( pWin->backgroundState != None )
+		RPIPaintBackground( pWin, &reg );
+	RegionUninit( &reg );
+}
+
+// Window moves and resizes with gravity. On the screen the old contents are
+// copied on the GPU; redirected windows move within their pixmap through fb.
+void RPICopyWindow( WindowPtr pWin, DDXPointRec ptOldOrg, RegionPtr prgnSrc )
+{
+	RPIPtr state = RPIDrawableState(&pWin->drawable);
+
+	if( !RPIPrepareDraw(state, &pWin->drawable) )
+	{
+		fbCopyWindow(pWin, ptOldOrg, prgnSrc);
+		RPIPixmapDamage(&pWin->drawable);
+		return;
+	}
+
+	int dx = pWin->drawable.x - ptOldOrg.x;
+	int dy = pWin->drawable.y - ptOldOrg.y;
+	RegionRec rgnDst;
+	RegionNull( &rgnDst );
+	RegionTranslate( prgnSrc, dx, dy );
+	RegionIntersect( &rgnDst, &pWin->borderClip, prgnSrc );
+	RPICopyScreenRegion( state, GL_COPY, &rgnDst, dx, dy );
+	RegionUninit( &rgnDst );
 }
 
 PixmapPtr RPICreatePixmap( ScreenPtr pScreen, int w, int h, int d, int hint )
 {
 	ErrorF("RPICreatePixmap\n");
-	return fbCreatePixmapBpp( pScreen, w, h, d, 32, hint );
+	return fbCreatePixmap( pScreen, w, h, d, hint );
 }
 
+// MIT-SHM pixmaps: the segment is the pixmap's bits, as with
+// fbShmCreatePixmap, and marked so uploads check it for client writes
+static PixmapPtr RPIShmCreatePixmap( ScreenPtr pScreen, int width, int height, int depth, char* addr )
+{
+	PixmapPtr pPix = pScreen->CreatePixmap(pScreen, 0, 0, depth, 0);
+	if( pPix == NullPixmap )
+		return NullPixmap;
+	if( !pScreen->ModifyPixmapHeader(pPix, width, height, depth, BitsPerPixel(depth), PixmapBytePad(width, depth), (pointer)addr) )
+	{
+		pScreen->DestroyPixmap(pPix);
+		return NullPixmap;
+	}
+	RPIGetPixmapPriv(pPix)->shm = TRUE;
+	return pPix;
+}
+
+static ShmFuncs RPIShmFuncs = {
+	.CreatePixmap = RPIShmCreatePixmap,
+};
+
 Bool RPIDestroyPixmap( PixmapPtr p )
 {
 	ErrorF("RPIDestroyPixmap\n");
+	if( p->refcnt == 1 )
+	{
+		RPITexCacheForget( RPIPTR(xf86Screens[p->drawable.pScreen->myNum]), p );
+	}
 	return fbDestroyPixmap(p);
 }
 
@@ -634,6 +3570,8 @@ Bool RPISetCursorPosition( DeviceIntPtr pDev, ScreenPtr pScreen, int x, int y, B
 
 static Bool RPICreateGC( GCPtr pGC )
 {
+	if( !fbCreateGC(pGC) )
+		return FALSE;
 	pGC->ops = &RPIGCOps;
 	pGC->funcs = &RPIGCFuncs;
 	ScreenPtr pScreen = pGC->pScreen;	
@@ -675,14 +3613,435 @@ void RPIResolveColor( short unsigned int* pred, short unsigned int* pgreen, shor
 	ErrorF("RPIResolveColor\n");
 }
 
+// Fetches word i of a bitmap row with the leftmost pixel in the least
+// significant bit
+static inline CARD32 RPIBitmapWord( const CARD32* row, int i )
+{
+	CARD32 w = row[i];
+#if BITMAP_BIT_ORDER == MSBFirst
+	w = ((w >> 1) & 0x55555555) | ((w & 0x55555555) << 1);
+	w = ((w >> 2) & 0x33333333) | ((w & 0x33333333) << 2);
+	w = ((w >> 4) & 0x0f0f0f0f) | ((w & 0x0f0f0f0f) << 4);
+	w = ((w >> 8) & 0x00ff00ff) | ((w & 0x00ff00ff) << 8);
+	w = (w >> 16) | (w << 16);
+#endif
+	return w;
+}
+
+// Appends a one row box to the region data, growing it as needed
+static Bool RPIRegDataAppend( RegDataPtr* pData, int x1, int x2, int y )
+{
+	RegDataPtr data = *pData;
+	if( data->numRects == data->size )
+	{
+		data = realloc( data, sizeof(RegDataRec) + sizeof(BoxRec) * data->size * 2 );
+		if( data == NULL )
+			return FALSE;
+		data->size *= 2;
+		*pData = data;
+	}
+	BoxPtr box = (BoxPtr)(data + 1) + data->numRects++;
+	box->x1 = x1;
+	box->x2 = x2;
+	box->y1 = y;
+	box->y2 = y + 1;
+	return TRUE;
+}
+
+// Appends the runs of set bits in one row to the region data. Returns the
+// number of runs, or -1 when out of memory.
+static int RPIBitmapRowRuns( const CARD32* row, int width, int y, RegDataPtr* pData )
+{
+	const int nWords = (width + 31) >> 5;
+	const CARD32 lastMask = (width & 31) ? ((CARD32)1 << (width & 31)) - 1 : ~(CARD32)0;
+	long first = (*pData)->numRects;
+	Bool inRun = FALSE;
+	int start = 0;
+
+	for( int i = 0; i < nWords; ++i )
+	{
+		CARD32 bits = RPIBitmapWord(row, i);
+		if( i == nWords - 1 )
+			bits &= lastMask;
+		// Whole words of background, or of the current run, need no bit work
+		if( bits == (inRun ? ~(CARD32)0 : 0) )
+			continue;
+
+		// Hop from one transition to the next
+		int pos = 0;
+		for( ;; )
+		{
+			CARD32 look = (inRun ? ~bits : bits) & (~(CARD32)0 << pos);
+			if( look == 0 )
+				break;
+			pos = __builtin_ctz(look);
+			if( inRun && !RPIRegDataAppend(pData, start, (i << 5) + pos, y) )
+				return -1;
+			start = (i << 5) + pos;
+			inRun = !inRun;
+		}
+	}
+	if( inRun && !RPIRegDataAppend(pData, start, width, y) )
+		return -1;
+	return (*pData)->numRects - first;
+}
+
+// Builds the region of set bits in a 1 bpp pixmap in a single pass. Each
+// row is scanned a word at a time for runs, and a row whose runs match the
+// band above it extends that band instead of starting a new one, which
+// also keeps the region in the canonical form the region code expects.
 RegionPtr RPIBitmapToRegion( PixmapPtr pPixmap )
 {
-  return RegionCreate(NULL,1);
+	const int width = pPixmap->drawable.width;
+	const int height = pPixmap->drawable.height;
+	RegionPtr pReg = RegionCreate(NULL, 1);
+	RegDataPtr data;
+	long bandStart = 0, bandSize = 0;
+
+	if( pReg == NULL || width <= 0 || height <= 0 )
+		return pReg;
+
+	data = malloc( sizeof(RegDataRec) + sizeof(BoxRec) * 64 );
+	if( data == NULL )
+		goto fail;
+	data->size = 64;
+	data->numRects = 0;
+
+	for( int y = 0; y < height; ++y )
+	{
+		const CARD32* row = (const CARD32*)((const CARD8*)pPixmap->devPrivate.ptr + y * pPixmap->devKind);
+		int n = RPIBitmapRowRuns( row, width, y, &data );
+		if( n < 0 )
+			goto fail;
+
+		BoxPtr boxes = (BoxPtr)(data + 1);
+		if( n > 0 && n == bandSize && boxes[bandStart].y2 == y )
+		{
+			BoxPtr band = &boxes[bandStart];
+			BoxPtr cur = &boxes[bandStart + bandSize];
+			int i;
+			for( i = 0; i < n; ++i )
+			{
+				if( band[i].x1 != cur[i].x1 || band[i].x2 != cur[i].x2 )
+					break;
+			}
+			if( i == n )
+			{
+				for( i = 0; i < n; ++i )
+					band[i].y2 = y + 1;
+				data->numRects -= n;
+				continue;
+			}
+		}
+		bandStart = data->numRects - n;
+		bandSize = n;
+	}
+
+	BoxPtr boxes = (BoxPtr)(data + 1);
+	if( data->numRects == 0 )
+	{
+		free(data);
+		return pReg;
+	}
+
+	pReg->extents.x1 = MAXSHORT;
+	pReg->extents.x2 = MINSHORT;
+	for( long i = 0; i < data->numRects; ++i )
+	{
+		pReg->extents.x1 = min( pReg->extents.x1, boxes[i].x1 );
+		pReg->extents.x2 = max( pReg->extents.x2, boxes[i].x2 );
+	}
+	pReg->extents.y1 = boxes[0].y1;
+	pReg->extents.y2 = boxes[data->numRects - 1].y2;
+	if( data->numRects == 1 )
+	{
+		free(data);
+		pReg->data = NULL;
+	}
+	else
+		pReg->data = data;
+	return pReg;
+
+fail:
+	free(data);
+	RegionDestroy(pReg);
+	return NullRegion;
+}
+
+// Maps the capture ring named by the Capture option, CaptureSize MB of
+// data (16 by default) rounded up to a power of two, and resets it for a
+// new reader session
+static void RPICaptureInit( ScrnInfoPtr pScrn )
+{
+	RPIPtr state = RPIPTR(pScrn);
+	const char* name = xf86GetOptValString(state->Options, OPTION_CAPTURE);
+	int mb = 16;
+	int fd;
+
+	if( name == NULL || state->capture != NULL )
+		return;
+	xf86GetOptValInteger(state->Options, OPTION_CAPTURE_SIZE, &mb);
+	// A power of two divides 2^32, so head % size stays continuous when
+	// the byte counters wrap
+	mb = RPINextPow2( max(1, min(mb, 1024)) );
+
+	// Anything smaller could never take a full screen update
+	size_t frameSize = sizeof(RPICaptureFrame) + sizeof(RPICaptureRect) +
+			(size_t)((state->width * (pScrn->bitsPerPixel / 8) + 3) & ~3) * state->height;
+	if( ((size_t)mb << 20) < frameSize )
+	{
+		WARNING_MSG("CaptureSize %d MB cannot hold a %dx%d frame, not exporting to %s", mb, state->width, state->height, name);
+		return;
+	}
+
+	size_t mapSize = RPI_CAPTURE_DATA_OFFSET + ((size_t)mb << 20);
+	if( (fd = shm_open(name, O_CREAT | O_RDWR, 0600)) < 0 )
+	{
+		WARNING_MSG("Unable to open capture ring %s: %s", name, strerror(errno));
+		return;
+	}
+	void* map = ftruncate(fd, mapSize) == 0 ? mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if( map == MAP_FAILED )
+	{
+		WARNING_MSG("Unable to map capture ring %s: %s", name, strerror(errno));
+		return;
+	}
+
+	RPICaptureHeader* hdr = map;
+	hdr->magic = 0;
+	__sync_synchronize();
+	hdr->version = RPI_CAPTURE_VERSION;
+	hdr->size = (uint32_t)mb << 20;
+	hdr->depth = pScrn->depth;
+	hdr->bitsPerPixel = pScrn->bitsPerPixel;
+	hdr->dropped = 0;
+	hdr->head = 0;
+	hdr->tail = 0;
+	__sync_synchronize();
+	hdr->magic = RPI_CAPTURE_MAGIC;
+	state->capture = hdr;
+	state->captureMapSize = mapSize;
+	INFO_MSG("Exporting screen updates to %s (%d MB ring)", name, mb);
+}
+
+static void RPICaptureFini( RPIPtr state )
+{
+	if( state->capture == NULL )
+		return;
+	munmap( state->capture, state->captureMapSize );
+	state->capture = NULL;
+	// Registered on the root window, so already gone with it
+	state->captureDamage = NULL;
+}
+
+// Bytes a frame of n rects takes in the ring
+static uint32_t RPICaptureFrameSize( const BoxRec* boxes, int n, int Bpp )
+{
+	uint32_t bytes = sizeof(RPICaptureFrame) + n * sizeof(RPICaptureRect);
+	for( int i = 0; i < n; ++i )
+		bytes += (((boxes[i].x2 - boxes[i].x1) * Bpp + 3) & ~3) * (boxes[i].y2 - boxes[i].y1);
+	return bytes;
+}
+
+// Pixels read back for the capture ring per block handler call
+#define RPI_CAPTURE_BUDGET (256 * 1024)
+
+// Rows of the damage, from the top, that RPI_CAPTURE_BUDGET pixels cover;
+// at least one, so that the export always progresses
+static int RPICaptureBandEnd( RegionPtr damaged )
+{
+	const BoxRec* boxes = RegionRects(damaged);
+	int n = RegionNumRects(damaged);
+	long used = 0;
+	int i = 0;
+
+	while( i < n )
+	{
+		// Region rects come in bands of equal y1 and y2
+		int y1 = boxes[i].y1;
+		int y2 = boxes[i].y2;
+		long width = 0;
+		for( ; i < n && boxes[i].y1 == y1; ++i )
+			width += boxes[i].x2 - boxes[i].x1;
+		long rows = (RPI_CAPTURE_BUDGET - used) / width;
+		if( rows < y2 - y1 )
+			return y1 + (used == 0 ? max(rows, 1) : rows);
+		used += width * (y2 - y1);
+	}
+	return RegionExtents(damaged)->y2;
+}
+
+// Appends the areas damaged since the last export to the capture ring.
+// GLES 1.1 has no pixel buffer objects, so glReadPixels blocks until the
+// GPU has drawn everything queued. This runs before the block handler
+// swaps, not right behind the swap, and reads at most RPI_CAPTURE_BUDGET
+// pixels. The rest of the damage waits for the next call.
+static void RPICaptureExport( ScrnInfoPtr pScrn )
+{
+	RPIPtr state = RPIPTR(pScrn);
+	ScreenPtr pScreen = screenInfo.screens[pScrn->scrnIndex];
+	RPICaptureHeader* hdr = state->capture;
+
+	if( hdr == NULL || state->surface == EGL_NO_SURFACE || state->hidden )
+		return;
+	if( state->captureDamage == NULL )
+	{
+		if( pScreen->root == NULL )
+			return;
+		state->captureDamage = DamageCreate(NULL, NULL, DamageReportNone, TRUE, pScreen, NULL);
+		if( state->captureDamage == NULL )
+			return;
+		DamageRegister(&pScreen->root->drawable, state->captureDamage);
+		// The reader starts with the whole screen
+		BoxRec all = { 0, 0, state->width, state->height };
+		RegionRec r;
+		RegionInit( &r, &all, 1 );
+		RegionUnion( DamageRegion(state->captureDamage), DamageRegion(state->captureDamage), &r );
+		RegionUninit( &r );
+	}
+
+	RegionPtr damaged = DamageRegion(state->captureDamage);
+	if( !RegionNotEmpty(damaged) )
+		return;
+	BoxRec screenBox = { 0, 0, state->width, state->height };
+	RegionRec screenRgn;
+	RegionInit( &screenRgn, &screenBox, 1 );
+	RegionIntersect( damaged, damaged, &screenRgn );
+	RegionUninit( &screenRgn );
+
+	if( !RegionNotEmpty(damaged) )
+		return;
+
+	// This frame takes the top band of the damage
+	BoxRec bandBox = { 0, RegionExtents(damaged)->y1, state->width, RPICaptureBandEnd(damaged) };
+	RegionRec part;
+	RegionInit( &part, &bandBox, 1 );
+	RegionIntersect( &part, &part, damaged );
+
+	int n = RegionNumRects(&part);
+	const BoxRec* boxes = RegionRects(&part);
+	int Bpp = pScrn->bitsPerPixel / 8;
+	uint32_t bytes = RPICaptureFrameSize( boxes, n, Bpp );
+	if( bytes > hdr->size )
+	{
+		// Per rect overhead can push a scattered update past the ring; its
+		// extents always fit what RPICaptureInit checked for
+		boxes = RegionExtents(&part);
+		n = 1;
+		bytes = RPICaptureFrameSize( boxes, n, Bpp );
+	}
+	if( bytes > hdr->size )
+	{
+		// The screen grew past the ring with RandR
+		WARNING_MSG("A %dx%d frame no longer fits the capture ring, export stopped", state->width, state->height);
+		RegionUninit( &part );
+		DamageUnregister( &pScreen->root->drawable, state->captureDamage );
+		DamageDestroy( state->captureDamage );
+		RPICaptureFini( state );
+		return;
+	}
+
+	CARD8* data = (CARD8*)hdr + RPI_CAPTURE_DATA_OFFSET;
+	uint32_t head = hdr->head;
+	uint32_t tail = hdr->tail;
+	__sync_synchronize();
+	uint32_t offset = head % hdr->size;
+	uint32_t pad = offset + bytes > hdr->size ? hdr->size - offset : 0;
+	if( pad > 0 && (head - tail) + pad <= hdr->size )
+	{
+		// The padding goes in as soon as it fits, so that a frame only the
+		// start of the ring can hold gets there once the reader catches up
+		if( pad >= sizeof(RPICaptureFrame) )
+		{
+			RPICaptureFrame* skip = (RPICaptureFrame*)(data + offset);
+			skip->size = pad;
+			skip->frame = 0;
+			skip->width = state->width;
+			skip->height = state->height;
+			skip->nRects = 0;
+		}
+		head += pad;
+		__sync_synchronize();
+		hdr->head = head;
+		offset = 0;
+		pad = 0;
+	}
+	if( pad > 0 || (head - tail) + bytes > hdr->size )
+	{
+		// Reader behind: keep the damage for the next frame
+		hdr->dropped++;
+		RegionUninit( &part );
+		return;
+	}
+
+	RPICaptureFrame* frame = (RPICaptureFrame*)(data + offset);
+	RPICaptureRect* rects = (RPICaptureRect*)(frame + 1);
+	CARD8* pixels = (CARD8*)(rects + n);
+	if( ++state->captureFrame == 0 )
+		state->captureFrame = 1;
+	frame->size = bytes;
+	frame->frame = state->captureFrame;
+	frame->width = state->width;
+	frame->height = state->height;
+	frame->nRects = n;
+	for( int i = 0; i < n; ++i )
+	{
+		int w = boxes[i].x2 - boxes[i].x1;
+		int h = boxes[i].y2 - boxes[i].y1;
+		rects[i].x = boxes[i].x1;
+		rects[i].y = boxes[i].y1;
+		rects[i].width = w;
+		rects[i].height = h;
+		rects[i].stride = (w * Bpp + 3) & ~3;
+		if( !RPIReadPixels(state, boxes[i].x1, boxes[i].y1, w, h, pixels, rects[i].stride) )
+		{
+			RegionUninit( &part );
+			return;
+		}
+		pixels += rects[i].stride * h;
+	}
+	__sync_synchronize();
+	hdr->head = head + bytes;
+	RegionSubtract( damaged, damaged, &part );
+	RegionUninit( &part );
 }
 
 void RPIBlockHandler( int sNum, pointer bData, pointer pTimeout, pointer pReadmask )
 {
 //	ErrorF("RPIBlockHandler\n");
+	ScrnInfoPtr pScrn = xf86Screens[sNum];
+	RPIPtr state = RPIPTR(pScrn);
+
+	// Clients may write their shm pixmaps until the next request arrives
+	state->shared->shmEpoch++;
+	// Read back for the capture ring before anything else is queued
+	RPICaptureExport( pScrn );
+	// After a VT switch the saved screen trickles back while idle
+	if( state->restoring && RPIMakeCurrent(state) )
+		RPIRestoreStep( state, RPI_RESTORE_BUDGET );
+	// Backgrounds exposed since the last draw
+	if( state->nBackgrounds > 0 && RPIMakeCurrent(state) )
+	{
+		RPILoadProjection( state );
+		RPIFlushBackgrounds( state );
+	}
+
+	// Present everything drawn on this screen during the dispatch cycle in
+	// one swap; each screen presents on its own display
+	if( state->dirty && !state->hidden && RPIMakeCurrent(state) )
+	{
+		eglSwapBuffers(state->shared->display, state->surface);
+		state->dirty = FALSE;
+		state->stencilValid = FALSE;
+		if( !state->presented )
+		{
+			state->presented = TRUE;
+			INFO_MSG("First frame on display %u after %u ms", state->displayNum,
+					(unsigned)(GetTimeInMillis() - state->shared->startTime));
+		}
+	}
+
 	struct timeval** tvpp = (struct timeval**)pTimeout;
 	(*tvpp)->tv_sec = 0;
 	(*tvpp)->tv_usec = 100;
@@ -742,7 +4101,9 @@ void RPIMarkWindow( WindowPtr pWin )
 
 void RPIHandleExposures( WindowPtr pWin )
 {
-	ErrorF("RPIHandleExposures\n");
+	// Backgrounds are only queued here; the next draw or the block handler
+	// paints them
+	miHandleValidateExposures(pWin);
 }
 
 Bool RPIDeviceCursorInitialize( DeviceIntPtr pDev, ScreenPtr pScreen )
@@ -764,6 +4125,13 @@ static Bool RPIScreenInit(int scrnNum, ScreenPtr pScreen, int argc, char** argv
     ErrorF("Unable to allocate fb privates\n");
     goto fail;
   }
+  if( !dixRegisterPrivateKey(&RPIGCPrivateKeyRec, PRIVATE_GC, sizeof(RPIGCPrivRec)) ||
+      !dixRegisterPrivateKey(&RPIPixmapPrivateKeyRec, PRIVATE_PIXMAP, sizeof(RPIPixmapPrivRec)) )
+  {
+    ErrorF("Unable to allocate rpi privates\n");
+    goto fail;
+  }
+  RPIPTR(pScrn)->shared->screens++;
   pScreen->defColormap = FakeClientID(0);  
   ErrorF("RPIScreenInit\n");
 	pScreen->CloseScreen = RPICloseScreen;
@@ -781,14 +4149,13 @@ static Bool RPIScreenInit(int scrnNum, ScreenPtr pScreen, int argc, char** argv
   pScreen->UnrealizeWindow = RPIUnrealizeWindow;
 	pScreen->ValidateTree = RPIValidateTree;
   //pScreen->PostValidateTree = RPIPostValidateTree;
-	pScreen->WindowExposures = RPIWindowExposures;
-  //pScreen->CopyWindow = RPICopyWindow;
-  pScreen->ClearToBackground = RPIClearToBackground;
+	pScreen->CopyWindow = RPICopyWindow;
 	//pScreen->ClipNotify = RPIClipNotify;
  	//pScreen->RestackWindow = RPIRestackWindow;
 
 	pScreen->CreatePixmap = RPICreatePixmap;
 	pScreen->DestroyPixmap = RPIDestroyPixmap;
+	ShmRegisterFuncs(pScreen, &RPIShmFuncs);
  
 	//pScreen->RealizeFont = RPIRealizeFont;
 	//pScreen->UnrealizeFont = RPIUnrealizeFont;
@@ -832,7 +4199,6 @@ static Bool RPIScreenInit(int scrnNum, ScreenPtr pScreen, int argc, char** argv
   //pScreen->MoveWindow;
   //pScreen->ResizeWindow;
   //pScreen->GetLayerWindow;
-	pScreen->HandleExposures = RPIHandleExposures;
   //pScreen->ReparentWindow;
 
   //pScreen->SetShape;
@@ -844,15 +4210,23 @@ static Bool RPIScreenInit(int scrnNum, ScreenPtr pScreen, int argc, char** argv
   //pScreen->DeviceCursorCleanup;
 	
   ErrorF("PictureInit\n");
-	if( !PictureInit( pScreen, NULL, 0 ) )
+	if( !fbPictureInit( pScreen, NULL, 0 ) )
 	{
 		ErrorF("PictureInit failed\n");
 		goto fail;
 	}
+	PictureScreenPtr ps = GetPictureScreen(pScreen);
+	ps->Composite = RPIComposite;
+	// fb would rasterize these straight into the window, the mi versions
+	// build a mask and go through Composite
+	ps->Trapezoids = miTrapezoids;
+	ps->Triangles = miTriangles;
+	ps->AddTraps = RPIAddTraps;
+	ps->AddTriangles = RPIAddTriangles;
 	PictureSetSubpixelOrder(pScreen,SubPixelHorizontalRGB);
 
 	miClearVisualTypes();
-	if( !miSetVisualTypes(pScrn->depth,TrueColorMask,pScrn->rgbBits, TrueColor) )
+	if( !miSetVisualTypesAndMasks(pScrn->depth,TrueColorMask,pScrn->rgbBits, TrueColor, pScrn->mask.red, pScrn->mask.green, pScrn->mask.blue) )
 	{
 		ErrorF("SetVisualTypes failed\n");
 		goto fail;
@@ -867,16 +4241,20 @@ static Bool RPIScreenInit(int scrnNum, ScreenPtr pScreen, int argc, char** argv
 	int numVisuals = 0;
 	int numDepths = 0;
 	VisualID defaultVis;	
-	if( !miInitVisuals(&pScreen->visuals,&pScreen->allowedDepths,&numVisuals,&numDepths,&rootDepth,&defaultVis,1<<31,8,-1) )
+	if( !miInitVisuals(&pScreen->visuals,&pScreen->allowedDepths,&numVisuals,&numDepths,&rootDepth,&defaultVis,1UL<<(pScrn->bitsPerPixel-1),pScrn->rgbBits,-1) )
 	{
 		ErrorF("InitVisuals failed\n" );
 		goto fail;
 	}
-  if( !miScreenInit(pScreen, 0, pScrn->currentMode->HDisplay, pScrn->currentMode->VDisplay, 96, 96, 4, rootDepth, numDepths, pScreen->allowedDepths, defaultVis, numVisuals, pScreen->visuals ) )
+  if( !miScreenInit(pScreen, 0, pScrn->virtualX, pScrn->virtualY, 96, 96, 4, rootDepth, numDepths, pScreen->allowedDepths, defaultVis, numVisuals, pScreen->visuals ) )
   {
     ErrorF("ScreenInit failed\n");
     goto fail;
   }
+	// miScreenInit installs the mi exposure handling
+	pScreen->WindowExposures = RPIWindowExposures;
+	pScreen->ClearToBackground = RPIClearToBackground;
+	pScreen->HandleExposures = RPIHandleExposures;
 	pScreen->numVisuals = numVisuals;
 	pScreen->numDepths = numDepths;
 	pScreen->rootDepth = rootDepth;
@@ -896,8 +4274,24 @@ static Bool RPIScreenInit(int scrnNum, ScreenPtr pScreen, int argc, char** argv
 		goto fail;
 	}
 
-	xf86DisableRandR();
 	xf86SetBackingStore(pScreen);
+	RPIPTR(pScrn)->EnableDisableFBAccess = pScrn->EnableDisableFBAccess;
+	pScrn->EnableDisableFBAccess = RPIEnableDisableFBAccess;
+	if( !RPIStartGL(pScrn) )
+	{
+		goto fail;
+	}
+	RPICaptureInit(pScrn);
+	if( !xf86CrtcScreenInit(pScreen) )
+	{
+		ErrorF("xf86CrtcScreenInit failed\n");
+		goto fail;
+	}
+	if( !xf86SetDesiredModes(pScrn) )
+	{
+		ErrorF("xf86SetDesiredModes failed\n");
+		goto fail;
+	}
 	if( !miCreateDefColormap(pScreen) )
   {
     ErrorF("miCreateDefColormap failed\n");
@@ -921,12 +4315,206 @@ fail:
 static Bool RPISwitchMode(int scrnNum, DisplayModePtr pMode, int flags)
 {
 	ErrorF( "RPISwitchMode\n" );
-	return TRUE;
+	return xf86SetSingleMode(xf86Screens[scrnNum], pMode, RR_Rotate_0);
 }
 
 static void RPIAdjustFrame(int scrnNum, int x, int y, int flags)
 {
-	ErrorF( "RPIAdjustFrame\n" );
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(xf86Screens[scrnNum]);
+	xf86CrtcPtr crtc = config->output[config->compat_output]->crtc;
+
+	if( crtc != NULL && crtc->enabled )
+		RPICrtcSetOrigin(crtc, x, y);
+}
+
+// Reads the screen back into a system memory shadow and gives up the
+// surface, element and cached textures. The shadow becomes the screen
+// pixmap's bits, so fb keeps drawing while the VT is away.
+static Bool RPISave( ScrnInfoPtr pScrn )
+{
+	RPIPtr state = RPIPTR(pScrn);
+	RPISharedPtr shared = state->shared;
+	ScreenPtr pScreen = screenInfo.screens[pScrn->scrnIndex];
+	int stride = PixmapBytePad(state->width, state->depth);
+	const int band = 64;
+	CARD8* shadow = malloc( (size_t)stride * state->height );
+
+	if( shadow == NULL )
+	{
+		WARNING_MSG("No memory to save the screen, keeping it on the GPU");
+		return FALSE;
+	}
+	for( int y = 0; y < state->height; y += band )
+	{
+		if( !RPIReadPixels(state, 0, y, state->width, min(band, state->height - y), shadow + (size_t)y * stride, stride) )
+		{
+			free( shadow );
+			return FALSE;
+		}
+	}
+
+	// Other screens refill the shared cache on demand
+	RPITexCacheFini( state );
+	eglMakeCurrent( shared->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT );
+	shared->current = NULL;
+	RPIDestroyGLSurface( state, state->surface, state->element, state->nativeWindow );
+	state->surface = EGL_NO_SURFACE;
+	state->element = DISPMANX_NO_HANDLE;
+	state->nativeWindow = NULL;
+
+	pScreen->ModifyPixmapHeader( pScreen->GetScreenPixmap(pScreen), -1, -1, -1, -1, stride, shadow );
+	state->shadow = shadow;
+	state->shadowStride = stride;
+	state->released = TRUE;
+	state->dirty = FALSE;
+	INFO_MSG("Released GPU memory, %dx%d screen kept in system memory", state->width, state->height);
+	return TRUE;
+}
+
+// Queues the shadow for upload: mapped top level windows first, then the
+// rest of the screen
+static void RPIRestoreBegin( ScrnInfoPtr pScrn )
+{
+	RPIPtr state = RPIPTR(pScrn);
+	ScreenPtr pScreen = screenInfo.screens[pScrn->scrnIndex];
+	BoxRec screenBox = { 0, 0, state->width, state->height };
+	RegionRec all;
+
+	RegionInit( &all, &screenBox, 1 );
+	RegionNull( &state->restoreFirst );
+	RegionNull( &state->restoreRest );
+	for( WindowPtr pWin = pScreen->root ? pScreen->root->firstChild : NULL; pWin != NULL; pWin = pWin->nextSib )
+	{
+		if( pWin->viewable )
+			RegionUnion( &state->restoreFirst, &state->restoreFirst, &pWin->borderClip );
+	}
+	RegionIntersect( &state->restoreFirst, &state->restoreFirst, &all );
+	RegionSubtract( &state->restoreRest, &all, &state->restoreFirst );
+	RegionUninit( &all );
+	state->restoring = TRUE;
+}
+
+// Draws one box of the shadow back onto the surface
+static Bool RPIRestoreBox( RPIPtr state, const BoxRec* box )
+{
+	RPITexturePtr t = &state->shared->upload;
+	int bpp = state->depth == 16 ? 16 : 32;
+	int w = box->x2 - box->x1;
+	int h = box->y2 - box->y1;
+
+	if( !RPIUploadImage(state, t, state->shadow + (size_t)box->y1 * state->shadowStride + box->x1 * (bpp / 8),
+			state->shadowStride, w, h, bpp) )
+		return FALSE;
+	RPIApplyFill( state, GL_COPY, t );
+	RPIFillBoxes( state, NULL, box, 1, t, box->x1, box->y1 );
+	return TRUE;
+}
+
+// Frees the shadow once the whole screen is back on the GPU, or once an
+// upload failed and the rest was given up
+static void RPIRestoreFinish( RPIPtr state )
+{
+	state->dirty = TRUE;
+	if( !RegionNotEmpty(&state->restoreFirst) && !RegionNotEmpty(&state->restoreRest) )
+	{
+		RegionUninit( &state->restoreFirst );
+		RegionUninit( &state->restoreRest );
+		free( state->shadow );
+		state->shadow = NULL;
+		state->restoring = FALSE;
+	}
+}
+
+// Uploads up to budget pixels of the shadow, a band of one box at a time
+static void RPIRestoreStep( RPIPtr state, long budget )
+{
+	RPILoadProjection( state );
+	while( budget > 0 )
+	{
+		RegionPtr r = RegionNotEmpty(&state->restoreFirst) ? &state->restoreFirst : &state->restoreRest;
+		if( !RegionNotEmpty(r) )
+			break;
+
+		BoxRec box = *RegionRects(r);
+		int w = box.x2 - box.x1;
+		int rows = min( box.y2 - box.y1, max(1, (int)min(budget / w, (long)INT_MAX)) );
+		box.y2 = box.y1 + rows;
+		if( !RPIRestoreBox(state, &box) )
+		{
+			RegionEmpty( &state->restoreFirst );
+			RegionEmpty( &state->restoreRest );
+			break;
+		}
+
+		RegionRec done;
+		RegionInit( &done, &box, 1 );
+		RegionSubtract( r, r, &done );
+		RegionUninit( &done );
+		budget -= (long)w * rows;
+	}
+	RPIRestoreFinish( state );
+}
+
+// Uploads whatever of the shadow is still pending inside area, so that a
+// draw or read there sees the restored screen. The rest of the screen
+// keeps coming back at the block handler's pace.
+static void RPIRestoreArea( RPIPtr state, const BoxRec* area )
+{
+	RegionPtr pending[2] = { &state->restoreFirst, &state->restoreRest };
+	RegionRec clip, part;
+
+	if( area->x1 >= area->x2 || area->y1 >= area->y2 )
+		return;
+	RPILoadProjection( state );
+	RegionInit( &clip, (BoxPtr)area, 1 );
+	RegionNull( &part );
+	for( int i = 0; i < 2; ++i )
+	{
+		RegionIntersect( &part, pending[i], &clip );
+		const BoxRec* boxes = RegionRects(&part);
+		Bool ok = TRUE;
+		for( int b = 0; ok && b < RegionNumRects(&part); ++b )
+			ok = RPIRestoreBox( state, &boxes[b] );
+		if( !ok )
+		{
+			RegionEmpty( &state->restoreFirst );
+			RegionEmpty( &state->restoreRest );
+			break;
+		}
+		RegionSubtract( pending[i], pending[i], &part );
+	}
+	RegionUninit( &part );
+	RegionUninit( &clip );
+	RPIRestoreFinish( state );
+}
+
+// Window contents stay valid across a VT switch, in the hidden surface or
+// in the shadow, so around LeaveVT/EnterVT the root clip is left alone and
+// nothing is re-exposed. xf86 disables access before it calls LeaveVT, so a
+// disable is held back until the enable shows whether a switch came in
+// between. RandR size changes still get xf86's default, which resizes the
+// root window and exposes it.
+static void RPIEnableDisableFBAccess( int scrnIndex, Bool enable )
+{
+	RPIPtr state = RPIPTR(xf86Screens[scrnIndex]);
+	Bool disabled = state->accessDisabled;
+
+	if( !enable )
+	{
+		state->accessDisabled = TRUE;
+		return;
+	}
+	state->accessDisabled = FALSE;
+	if( state->vtSwitched )
+	{
+		state->vtSwitched = FALSE;
+		return;
+	}
+	if( state->EnableDisableFBAccess == NULL )
+		return;
+	if( disabled )
+		state->EnableDisableFBAccess( scrnIndex, FALSE );
+	state->EnableDisableFBAccess( scrnIndex, TRUE );
 }
 
 static Bool RPIEnterVT(int scrnNum, int flags )
@@ -934,31 +4522,65 @@ static Bool RPIEnterVT(int scrnNum, int flags )
 	ScrnInfoPtr pScrn = xf86Screens[scrnNum];
 	RPIPtr state = RPIPTR(pScrn);
 	
-  glClearColor(0.0f, 0.0f, 1.0f, 1.0f);
-  glClear( GL_COLOR_BUFFER_BIT );
-  glHint( GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST );
-  glViewport( 0, 0, (GLsizei)state->width, (GLsizei)state->height );
+	if( state->released )
+	{
+		ScreenPtr pScreen = screenInfo.screens[scrnNum];
+		state->surface = RPICreateGLSurface( state, state->shared->display, state->shared->config );
+		if( state->surface == EGL_NO_SURFACE )
+		{
+			ERROR_MSG("Unable to recreate the surface on display %u", state->displayNum);
+			return FALSE;
+		}
+		state->released = FALSE;
+		pScreen->GetScreenPixmap(pScreen)->devPrivate.ptr = NULL;
+		RPIRestoreBegin( pScrn );
+	}
+	else if( state->hidden )
+		RPISetElementOpacity( state, 255 );
+	state->hidden = FALSE;
 
-  glMatrixMode( GL_PROJECTION );
-  glLoadIdentity();
-  glOrthof(0,state->width,state->height,0, 1, 100 );
-  eglSwapBuffers(state->display, state->surface);
+  if( !RPIMakeCurrent(state) )
+    return FALSE;
+  // The surface is preserved across the switch; present it again from the
+  // block handler instead of clearing and swapping here
+  state->projectionValid = FALSE;
+  state->stencilValid = FALSE;
+  state->dirty = TRUE;
 	ErrorF("RPIEnterVT %i %i\n", scrnNum, flags);
 	return TRUE;
 }
 
+// Hides the element and keeps everything resident, or with
+// ReleaseOnVTSwitch hands the GPU memory back to the console
 static void RPILeaveVT(int scrnNum, int flags)
 {
 	ErrorF("RPILeaveVT\n" );
 	ScrnInfoPtr pScrn = xf86Screens[scrnNum];
 	RPIPtr state = RPIPTR(pScrn);
-  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
-  glClear( GL_COLOR_BUFFER_BIT );
-  eglSwapBuffers(state->display, state->surface);
+
+	state->vtSwitched = TRUE;
+	if( xf86ReturnOptValBool(state->Options, OPTION_RELEASE_ON_VT_SWITCH, FALSE) && RPISave(pScrn) )
+		return;
+	if( state->surface == EGL_NO_SURFACE )
+		return;
+	RPISetElementOpacity( state, 0 );
+	state->hidden = TRUE;
 }
 
 static void RPIFreeScreen(int scrnNum, int flags)
 {
 	ErrorF("RPIFreeScreen\n" );
+	RPIPtr state = RPIPTR(xf86Screens[scrnNum]);
+	if( state != NULL && state->shared->screens == 0 )
+	{
+		if( RPITvCallbackRegistered )
+		{
+			vc_tv_unregister_callback( RPITvCallback );
+			RPITvCallbackRegistered = FALSE;
+		}
+		free(state->shared->scratch);
+		state->shared->scratch = NULL;
+		state->shared->scratchSize = 0;
+	}
 }
 
@@ -1,6 +1,8 @@
 #ifndef __RPI_VIDEO_H__
 #define __RPI_VIDEO_H__
 
+#include <pthread.h>
+#include <bcm_host.h>
 #include <EGL/egl.h>
 #include <GLES2/gl2.h>
 
@@ -29,10 +31,167 @@
 
 typedef enum {
 	OPTION_HW_CURSOR,
-	OPTION_NOACCEL
+	OPTION_NOACCEL,
+	OPTION_RENDER_SIZE,
+	OPTION_DISPLAY_RECT,
+	OPTION_DISPLAY,
+	OPTION_DEBUG_CONFIG,
+	OPTION_RELEASE_ON_VT_SWITCH,
+	OPTION_CAPTURE,
+	OPTION_CAPTURE_SIZE
 } RPIopts;
 
+#define RPI_TEX_CACHE_WAYS 4
+#define RPI_TEX_CACHE_SETS 16
+
+/* A GL copy of a pixmap, used for tiles and stipples. Entries are keyed by
+ * pixmap identity and serial number; the damage count is the pixmap's
+ * content generation at upload time. */
+typedef struct {
+  PixmapPtr pPix;
+  unsigned long serial;
+  unsigned long plane;   /* bit plane expanded to GL_ALPHA, 0 for all */
+  unsigned int damage;
+  unsigned int lastUse;
+  GLuint tex;
+  int width;
+  int height;
+  int texWidth;   /* power of two allocation */
+  int texHeight;
+  GLenum format;  /* GL format and type of the allocation */
+  GLenum type;
+  Bool alpha;     /* 1 bpp source or bit plane expanded to GL_ALPHA */
+  Bool tile;      /* wraps with GL_REPEAT, replicated if not a power of two */
+} RPITexture, *RPITexturePtr;
+
+/* Window background exposed since the last draw, painted in one go by
+ * RPIFlushBackgrounds. Queued regions never overlap. */
+typedef struct {
+  PixmapPtr tile;        /* referenced background pixmap, NULL for a colour */
+  Pixel pixel;
+  GLfloat color[4];
+  int orgX;              /* tile origin, screen coordinates */
+  int orgY;
+  RegionRec region;      /* screen coordinates */
+} RPIBackground;
+
+#define RPI_BACKGROUNDS 16
+
+typedef enum {
+	RPI_FILL_SOLID,
+	RPI_FILL_TILE,
+	RPI_FILL_STIPPLE,
+	RPI_FILL_OPAQUE_STIPPLE,
+	RPI_FILL_MASK          /* colour scaled by an a8 mask, for RENDER */
+} RPIFillProgram;
+
+/* Colour ramp of a gradient's stops, keyed by a hash of them */
+typedef struct {
+  uint64_t hash;
+  int nstops;
+  int repeat;            /* RepeatNormal wraps, RepeatPad clamps */
+  unsigned int lastUse;
+  RPITexture tex;
+} RPIRamp;
+
+#define RPI_RAMPS 8
+#define RPI_RAMP_SIZE 256
+
+/* GPU side GC state, rebuilt by RPIValidateGC */
+typedef struct {
+  RPIFillProgram program;
+  GLfloat fill[4];       /* colour for RPI_FILL_SOLID */
+  GLfloat fg[4];
+  GLfloat bg[4];
+  GLenum logicOp;        /* GL_COPY when no logic op is needed */
+  PixmapPtr fillPixmap;  /* tile or stipple for the program */
+  RPITexturePtr fillTex; /* last cache entry used for fillPixmap */
+  unsigned long clipSerial; /* changes whenever the composite clip does */
+} RPIGCPrivRec, *RPIGCPrivPtr;
+
 typedef struct {
+  unsigned int damage;   /* bumped whenever the contents change */
+  Bool shm;              /* bits are a MIT-SHM segment clients write directly */
+  unsigned int shmEpoch;   /* shm: RPISharedRec shmEpoch when damage was last bumped */
+} RPIPixmapPrivRec, *RPIPixmapPrivPtr;
+
+/* Screen capture ring, a POSIX shared memory object named by the Capture
+ * option. The server is the only writer and one local process reads.
+ * head and tail count bytes and only grow, wrapping at 2^32; the server
+ * owns head and the reader owns tail, and data lives at head % size. After each present, damaged screen areas are appended
+ * as an RPICaptureFrame, its RPICaptureRects, then each rect's pixels in
+ * the screen format, rows padded to 4 bytes. A frame with number 0 only
+ * pads to the end of the ring, and fewer than sizeof(RPICaptureFrame)
+ * bytes left before the end are skipped. When the reader falls behind,
+ * frames are dropped and their damage goes out with the next one. */
+#define RPI_CAPTURE_MAGIC 0x43495052  /* "RPIC" */
+#define RPI_CAPTURE_VERSION 1
+#define RPI_CAPTURE_DATA_OFFSET 64    /* ring data follows the header */
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;          /* bytes of ring data, a power of two */
+  uint32_t depth;
+  uint32_t bitsPerPixel;
+  uint32_t dropped;       /* frames skipped because the ring was full */
+  volatile uint32_t head;
+  volatile uint32_t tail;
+} RPICaptureHeader;
+
+typedef struct {
+  uint32_t size;          /* bytes including this header, a multiple of 4 */
+  uint32_t frame;
+  uint16_t width;         /* screen size */
+  uint16_t height;
+  uint32_t nRects;
+} RPICaptureFrame;
+
+typedef struct {
+  int16_t x;
+  int16_t y;
+  uint16_t width;
+  uint16_t height;
+  uint32_t stride;
+} RPICaptureRect;
+
+struct _RPIRec;
+
+/* One EGL context drives every screen, so textures and the GL state cache
+ * are shared; only surfaces and dispmanx elements are per display */
+typedef struct {
+  int screens;           /* screens initialised on the context */
+  struct _RPIRec* current; /* screen whose surface is current */
+  EGLDisplay display;
+  EGLConfig config;
+  EGLContext context;
+  int depth;             /* every screen renders with config's depth */
+  /* eglInitialize and eglChooseConfig run on initThread from PreInit and
+   * are joined in ScreenInit */
+  pthread_t initThread;
+  Bool initPending;
+  Bool initOk;
+  EGLint initError;
+  CARD32 startTime;      /* server time at the first PreInit */
+  void* scratch;         /* per-request vertex scratch space */
+  size_t scratchSize;
+  RPITexture texCache[RPI_TEX_CACHE_SETS * RPI_TEX_CACHE_WAYS];
+  RPITexture upload;     /* streaming texture for PutImage */
+  RPITexture copy;       /* band of the screen for screen to screen copies */
+  RPIRamp ramps[RPI_RAMPS];
+  unsigned int texClock;
+  unsigned int shmEpoch;   /* bumped every block handler, when clients may have written shm */
+  unsigned int texHits;
+  unsigned int texMisses;
+  Bool hasBGRA;          /* GL_EXT_texture_format_BGRA8888 */
+  /* GL state last applied by RPIApplyFill */
+  GLuint boundTex;
+  GLenum logicOp;
+  RPIFillProgram program;
+  GLenum alphaFunc;
+} RPISharedRec, *RPISharedPtr;
+
+typedef struct _RPIRec {
 //	Bool noAccel;
 //	Bool hwCursor;
 //	unsigned char* fbmem;
@@ -40,11 +199,50 @@ typedef struct {
 //	EntityInfoPtr EntityInfo;
 //	CloseScreenProcPtr CloseScreen;
 //	OptionInfoPtr Options;
-  int width;
+  OptionInfoPtr Options;
+  int depth;             /* 16 (RGB565) or 24 (x8r8g8b8) */
+  int width;             /* render size: the EGL surface and X screen */
   int height;
-  EGLDisplay display;
+  int displayWidth;      /* physical display size */
+  int displayHeight;
+  VC_RECT_T srcRect;     /* part of the surface shown, the CRTC viewport */
+  VC_RECT_T dstRect;     /* where dispmanx scales the surface to */
+  Bool fixedSize;        /* RenderSize/DisplayRect given, no mode switching */
+  Bool fixedRect;        /* DisplayRect given */
+  RPISharedPtr shared;
+  uint32_t displayNum;   /* dispmanx display this screen scans out on */
+  DISPMANX_DISPLAY_HANDLE_T dispmanDisplay;
+  DISPMANX_ELEMENT_HANDLE_T element;
+  EGL_DISPMANX_WINDOW_T* nativeWindow;
   EGLSurface surface;
-  EGLContext context;
+  Bool dirty;            /* surface has been drawn to since the last swap */
+  Bool presented;        /* first frame has been swapped */
+  /* VT switching: the element is either hidden with the surface kept, or
+   * the surface is released and fb draws into a system memory shadow that
+   * is uploaded again, visible windows first, after EnterVT */
+  Bool hidden;
+  Bool released;
+  CARD8* shadow;
+  int shadowStride;
+  Bool restoring;
+  Bool vtSwitched;       /* LeaveVT ran since access was last enabled */
+  Bool accessDisabled;   /* a disable waits for the enable that follows */
+  xf86EnableDisableFBAccessProc* EnableDisableFBAccess; /* xf86's default */
+  RegionRec restoreFirst;  /* top level windows, restored first */
+  RegionRec restoreRest;
+  RPICaptureHeader* capture; /* mapped capture ring, NULL when off */
+  size_t captureMapSize;
+  DamagePtr captureDamage;   /* screen areas changed since the last export */
+  uint32_t captureFrame;
+  RPIBackground backgrounds[RPI_BACKGROUNDS];
+  int nBackgrounds;
+  Bool projectionValid;  /* GL projection matches the surface */
+  Bool stencilValid;     /* stencil cleared since the last swap */
+  /* Complex clips are kept in the low stencil bits, tagged with an id */
+  unsigned long stencilClipSerial;
+  GLint stencilClipId;
+  GLint clipRef;         /* stencil test of the active clip, 0 if none */
+  GLuint clipMask;
 } RPIRec, *RPIPtr, *FBDevPtr;
 
 static void RPIIdentify(int);
@@ -58,6 +256,7 @@ static Bool RPISwitchMode(int, DisplayModePtr, int);
 static void RPIAdjustFrame(int, int, int, int); 
 static Bool RPIEnterVT(int, int);
 static void RPILeaveVT(int, int);
+static void RPIEnableDisableFBAccess(int, Bool);
 static void RPIFreeScreen(int, int);
 
 #define RPIPTR(p) ((RPIPtr)((p)->driverPrivate))